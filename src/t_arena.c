@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at netbsd org>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * The tests of the arena internals: the source is included, so that
+ * the static routines can be reached.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "ttimer_arena.c"
+
+static const unsigned shifts[] = {
+	0, ARENA_SHIFT(1), ARENA_SHIFT(2), ARENA_SHIFT(3)
+};
+
+/*
+ * arena_targets_check: the kernel (SIMD, if compiled in) must agree
+ * with the scalar version on every entry of the batch.
+ */
+static void
+arena_targets_check(const uint32_t *rem, unsigned count)
+{
+	const unsigned nshifts = sizeof(shifts) / sizeof(shifts[0]);
+
+	for (unsigned s = 0; s < nshifts; s++) {
+		uint32_t head[ARENA_CHUNK], nrem[ARENA_CHUNK];
+
+		tarena_targets(rem, head, nrem, count, shifts[s]);
+		for (unsigned i = 0; i < count; i++) {
+			uint32_t h, r;
+
+			tarena_target(rem[i], shifts[s], &h, &r);
+			assert(head[i] == h && nrem[i] == r);
+		}
+	}
+}
+
+static void
+arena_targets(void)
+{
+	/* The boundaries of the "digits" and beyond the levels. */
+	static const uint32_t edges[] = {
+		0, 1, 255, 256, 257, 65535, 65536, 65537,
+		(1U << 24) - 1, 1U << 24, UINT32_MAX
+	};
+	const unsigned nedges = sizeof(edges) / sizeof(edges[0]);
+	uint32_t rem[ARENA_CHUNK];
+
+	/* Each boundary at each position of the full batch. */
+	for (unsigned e = 0; e < nedges; e++) {
+		for (unsigned i = 0; i < ARENA_CHUNK; i++) {
+			rem[i] = edges[(e + i) % nedges];
+		}
+		arena_targets_check(rem, ARENA_CHUNK);
+	}
+
+	/* The partial last batch: padded with zeros, as in the cascade. */
+	for (unsigned count = 1; count < ARENA_CHUNK; count++) {
+		for (unsigned i = 0; i < ARENA_CHUNK; i++) {
+			rem[i] = (i < count) ? edges[i % nedges] : 0;
+		}
+		arena_targets_check(rem, count);
+	}
+
+	/* Random ones. */
+	for (unsigned round = 0; round < 10000; round++) {
+		for (unsigned i = 0; i < ARENA_CHUNK; i++) {
+			rem[i] = (uint32_t)random() >> (random() % 32);
+		}
+		arena_targets_check(rem, ARENA_CHUNK);
+	}
+}
+
+int
+main(void)
+{
+	arena_targets();
+	puts("ok");
+	return 0;
+}
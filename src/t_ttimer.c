@@ -130,12 +130,1623 @@ ttimer_random(void)
 	ttimer_destroy(timer);
 }
 
+static void
+count_handler(ttimer_ref_t *ent, void *arg)
+{
+	(*(unsigned *)arg)++;
+	(void)ent;
+}
+
+static void
+ttimer_catchup(void)
+{
+	const unsigned nent = 64, maxt = 256 * 256;
+	ttimer_ref_t ent[nent];
+	unsigned fired[nent];
+	time_t deadline[nent];
+	time_t now = 0;
+	ttimer_t *timer;
+
+	timer = ttimer_create(maxt, now);
+	assert(timer);
+
+	for (unsigned i = 0; i < nent; i++) {
+		fired[i] = 0;
+		deadline[i] = (random() % maxt) + 1;
+		ttimer_setfunc(&ent[i], count_handler, &fired[i]);
+		ttimer_start(timer, &ent[i], deadline[i]);
+	}
+
+	/* Advance in random jumps: each entry must fire exactly once. */
+	while (now <= maxt) {
+		now += (random() % 1024) + 1;
+		ttimer_run_ticks(timer, now);
+
+		for (unsigned i = 0; i < nent; i++) {
+			assert(fired[i] == (deadline[i] <= now));
+			assert(ent[i].scheduled == (deadline[i] > now));
+		}
+	}
+	ttimer_destroy(timer);
+}
+
+static unsigned fireseq = 0;
+
+static void
+seq_handler(ttimer_ref_t *ent, void *arg)
+{
+	*(unsigned *)arg = ++fireseq;
+	(void)ent;
+}
+
+static void
+ttimer_fastforward(void)
+{
+	const unsigned nent = 256;
+	const time_t maxt = 3 * (256UL * 256 * 256);
+	ttimer_ref_t ent[nent];
+	unsigned seq[nent];
+	time_t deadline[nent];
+	time_t now = 0;
+	ttimer_t *timer;
+
+	timer = ttimer_create(0, now);
+	assert(timer);
+
+	/* Spread the entries across all levels and beyond. */
+	for (unsigned i = 0; i < nent; i++) {
+		seq[i] = 0;
+		deadline[i] = (random() % maxt) + 1;
+		ttimer_setfunc(&ent[i], seq_handler, &seq[i]);
+		ttimer_start(timer, &ent[i], deadline[i]);
+	}
+
+	/* Large jumps: must fire on time and in the deadline order. */
+	while (now <= maxt) {
+		now += (random() % (1UL << 20)) + 1;
+		ttimer_run_ticks(timer, now);
+
+		for (unsigned i = 0; i < nent; i++) {
+			assert((seq[i] != 0) == (deadline[i] <= now));
+		}
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		for (unsigned j = 0; j < nent; j++) {
+			assert(deadline[i] >= deadline[j] || seq[i] < seq[j]);
+		}
+	}
+
+	/* A very long idle gap must not spin through every tick. */
+	ttimer_start(timer, &ent[0], 1);
+	now += (time_t)1 << 40;
+	ttimer_run_ticks(timer, now);
+	assert(!ent[0].scheduled);
+
+	ttimer_destroy(timer);
+}
+
+static void
+ttimer_expiry(void)
+{
+	const unsigned nent = 64, maxt = 256 * 256 * 4;
+	ttimer_ref_t ent[nent];
+	unsigned fired[nent];
+	time_t deadline[nent];
+	time_t now = 0, next;
+	ttimer_t *timer;
+
+	timer = ttimer_create(maxt, now);
+	assert(timer);
+	assert(ttimer_next_expiry(timer) == -1);
+
+	/* Level 0: exact value. */
+	fired[0] = 0;
+	ttimer_setfunc(&ent[0], count_handler, &fired[0]);
+	ttimer_start(timer, &ent[0], 100);
+	assert(ttimer_next_expiry(timer) == 100);
+	ttimer_stop(timer, &ent[0]);
+	assert(ttimer_next_expiry(timer) == -1);
+
+	for (unsigned i = 0; i < nent; i++) {
+		fired[i] = 0;
+		deadline[i] = (random() % maxt) + 1;
+		ttimer_setfunc(&ent[i], count_handler, &fired[i]);
+		ttimer_start(timer, &ent[i], deadline[i]);
+	}
+
+	/*
+	 * Sleep until the next expiry: nothing may fire before it and
+	 * it must never be past the earliest deadline.
+	 */
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		time_t earliest = -1;
+
+		for (unsigned i = 0; i < nent; i++) {
+			if (ent[i].scheduled && (earliest == -1 ||
+			    deadline[i] < earliest)) {
+				earliest = deadline[i];
+			}
+		}
+		assert(next > 0 && now + next <= earliest);
+
+		now += next - 1;
+		ttimer_run_ticks(timer, now);
+		for (unsigned i = 0; i < nent; i++) {
+			assert(fired[i] == (deadline[i] <= now));
+		}
+		ttimer_run_ticks(timer, ++now);
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(fired[i] == 1);
+	}
+	ttimer_destroy(timer);
+}
+
+static void
+wakeup_handler(ttimer_t *timer, time_t wakeup, void *arg)
+{
+	*(time_t *)arg = wakeup;
+	(void)timer;
+}
+
+static void
+ttimer_tickless(void)
+{
+	const time_t start = 1000;
+	ttimer_ref_t ent1, ent2;
+	unsigned fired1 = 0, fired2 = 0;
+	time_t notified = -1, now = start;
+	ttimer_t *timer;
+
+	timer = ttimer_create(0, now);
+	assert(timer);
+	ttimer_setwakeup(timer, wakeup_handler, &notified);
+	ttimer_setfunc(&ent1, count_handler, &fired1);
+	ttimer_setfunc(&ent2, count_handler, &fired2);
+	assert(ttimer_next_wakeup(timer) == -1);
+
+	/* The first timer: must notify about the new wake-up time. */
+	ttimer_start(timer, &ent1, 200);
+	assert(notified == start + 200);
+	assert(ttimer_next_wakeup(timer) == start + 200);
+
+	/* Later timer: no change; earlier timer: updated. */
+	notified = -1;
+	ttimer_start(timer, &ent2, 250);
+	assert(notified == -1);
+	ttimer_stop(timer, &ent2);
+	ttimer_start(timer, &ent2, 50);
+	assert(notified == start + 50);
+	assert(ttimer_next_wakeup(timer) == start + 50);
+
+	/* Sleep until the wake-up times only. */
+	now = ttimer_next_wakeup(timer);
+	ttimer_run_ticks(timer, now);
+	assert(fired1 == 0 && fired2 == 1);
+
+	now = ttimer_next_wakeup(timer);
+	assert(now == start + 200);
+	ttimer_run_ticks(timer, now);
+	assert(fired1 == 1 && fired2 == 1);
+	assert(ttimer_next_wakeup(timer) == -1);
+
+	ttimer_destroy(timer);
+}
+
+static void
+ttimer_bounded(void)
+{
+	const unsigned nent = 1000;
+	ttimer_ref_t *ent = calloc(nent, sizeof(ttimer_ref_t));
+	unsigned *seq = calloc(nent, sizeof(unsigned));
+	unsigned fired = 0, lastseq;
+	ttimer_t *timer;
+	bool done;
+
+	timer = ttimer_create(0, 0);
+	assert(timer && ent && seq);
+
+	/* Half of the entries expire at 10 and the other half at 20. */
+	for (unsigned i = 0; i < nent; i++) {
+		ttimer_setfunc(&ent[i], seq_handler, &seq[i]);
+		ttimer_start(timer, &ent[i], i < nent / 2 ? 10 : 20);
+	}
+
+	/* At most 300 calls per run: must resume without reordering. */
+	fireseq = 0;
+	do {
+		done = ttimer_run_ticks_bounded(timer, 30, 300, 0);
+		assert(fireseq - fired <= 300);
+		assert(done || fireseq - fired == 300);
+		fired = fireseq;
+		assert(ttimer_next_expiry(timer) == (done ? -1 : 0));
+	} while (!done);
+	assert(fired == nent);
+
+	lastseq = 0;
+	for (unsigned i = 0; i < nent / 2; i++) {
+		lastseq = seq[i] > lastseq ? seq[i] : lastseq;
+	}
+	for (unsigned i = nent / 2; i < nent; i++) {
+		assert(seq[i] > lastseq);
+	}
+
+	/* Stopping the pending entry must prevent its handler. */
+	ttimer_start(timer, &ent[0], 5);
+	ttimer_start(timer, &ent[1], 5);
+	seq[0] = seq[1] = 0;
+	assert(!ttimer_run_ticks_bounded(timer, 40, 1, 0));
+	assert(seq[0] || seq[1]);
+	assert(ttimer_stop(timer, &ent[seq[0] ? 1 : 0]));
+	assert(ttimer_run_ticks_bounded(timer, 40, 1, 0));
+	assert(!seq[0] || !seq[1]);
+
+	/* Time budget: at least one handler per call. */
+	for (unsigned i = 0; i < nent; i++) {
+		ttimer_start(timer, &ent[i], 1);
+	}
+	fired = fireseq;
+	while (!ttimer_run_ticks_bounded(timer, 41, 0, 1)) {
+		assert(fireseq > fired);
+		fired = fireseq;
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(!ent[i].scheduled);
+	}
+
+	ttimer_destroy(timer);
+	free(seq);
+	free(ent);
+}
+
+static void
+ttimer_batch_collect(void)
+{
+	const unsigned nent = 100;
+	ttimer_ref_t ent[nent], *vec[32];
+	unsigned fired = 0, total = 0;
+	time_t deadline[nent];
+	time_t last = 0;
+	ttimer_t *timer;
+	size_t n;
+
+	timer = ttimer_create(0, 0);
+	assert(timer);
+
+	for (unsigned i = 0; i < nent; i++) {
+		deadline[i] = (random() % 1000) + 1;
+		ttimer_setfunc(&ent[i], count_handler, &fired);
+		ttimer_start(timer, &ent[i], deadline[i]);
+	}
+
+	/*
+	 * Collect in the batches of 32: the handlers are not called and
+	 * the entries come out in the order of their deadlines.
+	 */
+	while ((n = ttimer_collect(timer, 2000, vec, 32)) != 0) {
+		for (unsigned i = 0; i < n; i++) {
+			const unsigned idx = vec[i] - ent;
+
+			assert(idx < nent);
+			assert(!ent[idx].scheduled);
+			assert(deadline[idx] >= last);
+			last = deadline[idx];
+		}
+		total += n;
+	}
+	assert(total == nent);
+	assert(fired == 0);
+
+	ttimer_destroy(timer);
+}
+
+static void
+ttimer_cascade(void)
+{
+	const unsigned nent = 4096;
+	ttimer_ref_t *ent = calloc(nent, sizeof(ttimer_ref_t));
+	time_t *deadline = calloc(nent, sizeof(time_t));
+	unsigned *fired = calloc(nent, sizeof(unsigned));
+	time_t now = 0;
+	ttimer_t *timer;
+
+	timer = ttimer_create(0, now);
+	assert(timer && ent && deadline && fired);
+
+	/*
+	 * Many entries with a few distinct timeouts, so that the runs of
+	 * the same target are spliced; random starts, stops and ticks.
+	 */
+	for (unsigned i = 0; i < nent; i++) {
+		ttimer_setfunc(&ent[i], count_handler, &fired[i]);
+	}
+	for (unsigned round = 0; round < 2000; round++) {
+		const time_t timeout = (random() % 4) ?
+		    (time_t)(256 * 256 + 17) : (time_t)(random() % 70000) + 1;
+
+		for (unsigned k = 0; k < 32; k++) {
+			const unsigned i = random() % nent;
+
+			if (ent[i].scheduled) {
+				assert(ttimer_stop(timer, &ent[i]));
+				deadline[i] = 0;
+				continue;
+			}
+			fired[i] = 0;
+			deadline[i] = now + timeout;
+			ttimer_start(timer, &ent[i], timeout);
+		}
+		now += random() % 512;
+		ttimer_run_ticks(timer, now);
+
+		for (unsigned i = 0; i < nent; i++) {
+			if (ent[i].scheduled) {
+				assert(deadline[i] > now && !fired[i]);
+			} else if (deadline[i] && deadline[i] <= now) {
+				assert(fired[i] <= 1);
+			}
+		}
+	}
+
+	/* Everything must fire exactly at the deadline. */
+	while (ttimer_next_expiry(timer) != -1) {
+		now += ttimer_next_expiry(timer);
+		ttimer_run_ticks(timer, now - 1);
+		for (unsigned i = 0; i < nent; i++) {
+			assert(ent[i].scheduled == (deadline[i] > now - 1));
+		}
+		ttimer_run_ticks(timer, now);
+		for (unsigned i = 0; i < nent; i++) {
+			assert(ent[i].scheduled == (deadline[i] > now));
+		}
+	}
+	ttimer_destroy(timer);
+	free(fired);
+	free(deadline);
+	free(ent);
+}
+
+static time_t		curtime;
+
+static void
+deadline_handler(ttimer_ref_t *ent, void *arg)
+{
+	time_t *deadline = arg;
+
+	assert(*deadline == curtime);
+	*deadline = 0;
+	(void)ent;
+}
+
+static void
+ttimer_incremental(void)
+{
+	const unsigned nent = 2048;
+	ttimer_ref_t *ent = calloc(nent, sizeof(ttimer_ref_t));
+	time_t *deadline = calloc(nent, sizeof(time_t));
+	ttimer_t *timer;
+	time_t next;
+
+	curtime = 0;
+	timer = ttimer_create_flags(0, curtime, TTIMER_INCREMENTAL);
+	assert(timer && ent && deadline);
+
+	for (unsigned i = 0; i < nent; i++) {
+		ttimer_setfunc(&ent[i], deadline_handler, &deadline[i]);
+	}
+
+	/*
+	 * Run tick by tick, so that the buckets are migrated gradually,
+	 * with the timeouts across all levels (and beyond the last one).
+	 * Every entry must fire exactly at its deadline.
+	 */
+	for (unsigned round = 0; round < 300000; round++) {
+		const unsigned i = random() % nent;
+		time_t timeout;
+
+		switch (random() % 4) {
+		case 0:
+			timeout = (random() % 1000) + 1;
+			break;
+		case 1:
+			timeout = (random() % 200000) + 1;
+			break;
+		case 2:
+			timeout = (time_t)(random() % (1 << 25)) + 1;
+			break;
+		default:
+			timeout = 256 * 256 + 17;
+			break;
+		}
+		if (ent[i].scheduled) {
+			assert(ttimer_stop(timer, &ent[i]));
+			deadline[i] = 0;
+		} else if (random() % 2) {
+			deadline[i] = curtime + timeout;
+			ttimer_start(timer, &ent[i], timeout);
+		}
+		ttimer_run_ticks(timer, ++curtime);
+	}
+
+	/* Drain the rest, jumping between the events. */
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(!ent[i].scheduled && deadline[i] == 0);
+	}
+	ttimer_destroy(timer);
+	free(deadline);
+	free(ent);
+}
+
+static void
+time_handler(ttimer_ref_t *ent, void *arg)
+{
+	*(time_t *)arg = curtime;
+	(void)ent;
+}
+
+static void
+ttimer_approx_run(time_t maxtimeout, time_t maxt)
+{
+	const unsigned nent = 1024;
+	ttimer_ref_t *ent = calloc(nent, sizeof(ttimer_ref_t));
+	time_t *timeout = calloc(nent, sizeof(time_t));
+	time_t *deadline = calloc(nent, sizeof(time_t));
+	time_t *fired = calloc(nent, sizeof(time_t));
+	ttimer_t *timer;
+	time_t next;
+
+	curtime = 0;
+	timer = ttimer_create_flags(maxtimeout, curtime, TTIMER_APPROX);
+	assert(timer && ent && timeout && deadline && fired);
+
+	for (unsigned i = 0; i < nent; i++) {
+		ttimer_setfunc(&ent[i], time_handler, &fired[i]);
+	}
+	for (unsigned round = 0; round < 20000; round++) {
+		const unsigned i = random() % nent;
+
+		if (ent[i].scheduled) {
+			assert(ttimer_stop(timer, &ent[i]));
+		} else {
+			timeout[i] = (random() % 4) ?
+			    (random() % 300) + 1 : (random() % maxt) + 1;
+			deadline[i] = curtime + timeout[i];
+			fired[i] = 0;
+			ttimer_start(timer, &ent[i], timeout[i]);
+		}
+		for (unsigned k = random() % 64; k; k--) {
+			ttimer_run_ticks(timer, ++curtime);
+		}
+	}
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+
+	/* Never early and late by less than 8/254 of the timeout. */
+	for (unsigned i = 0; i < nent; i++) {
+		if (fired[i]) {
+			assert(fired[i] >= deadline[i]);
+			assert((fired[i] - deadline[i]) * 254 < 8 * timeout[i]);
+		}
+	}
+	ttimer_destroy(timer);
+	free(fired);
+	free(deadline);
+	free(timeout);
+	free(ent);
+}
+
+static void
+ttimer_approx(void)
+{
+	/* All levels. */
+	ttimer_approx_run(0, 1 << 24);
+
+	/* Two levels: re-scheduling beyond the final level. */
+	ttimer_approx_run(1000, 10000);
+}
+
+static void
+ttimer_longterm(void)
+{
+	const unsigned nent = 512;
+	ttimer_ref_t ent[nent];
+	time_t deadline[nent];
+	unsigned steps = 0;
+	ttimer_t *timer;
+	time_t next;
+
+	curtime = 0;
+	timer = ttimer_create(0, curtime);
+	assert(timer);
+
+	/*
+	 * Timeouts far beyond the range of the wheel; stop some of them.
+	 * They must fire exactly and must not be re-processed while they
+	 * wait, i.e. only a few steps per entry.
+	 */
+	for (unsigned i = 0; i < nent; i++) {
+		const time_t timeout = (time_t)(random() % (1UL << 20)) << 20;
+
+		deadline[i] = timeout + 1;
+		ttimer_setfunc(&ent[i], deadline_handler, &deadline[i]);
+		ttimer_start(timer, &ent[i], deadline[i]);
+	}
+	for (unsigned i = 0; i < nent; i += 3) {
+		assert(ttimer_stop(timer, &ent[i]));
+		deadline[i] = 0;
+	}
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+		steps++;
+	}
+	assert(steps <= nent * 4);
+
+	for (unsigned i = 0; i < nent; i++) {
+		assert(!ent[i].scheduled && deadline[i] == 0);
+	}
+	ttimer_destroy(timer);
+}
+
+static void
+ttimer_geometry_run(unsigned bits, unsigned levels, unsigned flags)
+{
+	const unsigned nent = 512;
+	ttimer_ref_t ent[nent];
+	time_t deadline[nent];
+	ttimer_t *timer;
+	time_t next;
+
+	curtime = 0;
+	timer = ttimer_create_ex(bits, levels, curtime, flags);
+	assert(timer);
+
+	for (unsigned i = 0; i < nent; i++) {
+		deadline[i] = 0;
+		ttimer_setfunc(&ent[i], deadline_handler, &deadline[i]);
+	}
+
+	/*
+	 * Timeouts across all levels and beyond: must fire exactly,
+	 * both when running tick by tick and when jumping.
+	 */
+	for (unsigned round = 0; round < 20000; round++) {
+		const unsigned i = random() % nent;
+		const time_t timeout = (random() % 2) ?
+		    (random() % 5000) + 1 : (random() % (1 << 22)) + 1;
+
+		if (ent[i].scheduled) {
+			assert(ttimer_stop(timer, &ent[i]));
+			deadline[i] = 0;
+		} else {
+			deadline[i] = curtime + timeout;
+			ttimer_start(timer, &ent[i], timeout);
+		}
+		if (round % 2) {
+			ttimer_run_ticks(timer, ++curtime);
+		} else if ((next = ttimer_next_expiry(timer)) > 0) {
+			curtime += next;
+			ttimer_run_ticks(timer, curtime);
+		}
+	}
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(!ent[i].scheduled && deadline[i] == 0);
+	}
+	ttimer_destroy(timer);
+}
+
+static void
+ttimer_geometry(void)
+{
+	/* Unsupported geometry. */
+	assert(ttimer_create_ex(2, 3, 0, 0) == NULL);
+	assert(ttimer_create_ex(8, 0, 0, 0) == NULL);
+	assert(ttimer_create_ex(16, 8, 0, 0) == NULL);
+	assert(ttimer_create_ex(8, 2, 0, TTIMER_HASHED) == NULL);
+
+	/* Single-word bitmaps, large first level and sub-word wheels. */
+	ttimer_geometry_run(6, 6, 0);
+	ttimer_geometry_run(6, 3, 0);
+	ttimer_geometry_run(10, 2, 0);
+	ttimer_geometry_run(4, 5, 0);
+	ttimer_geometry_run(6, 4, TTIMER_INCREMENTAL);
+
+	/* Hashed wheel: a single level with the rounds. */
+	ttimer_geometry_run(8, 1, TTIMER_HASHED);
+	ttimer_geometry_run(12, 1, TTIMER_HASHED | TTIMER_APPROX);
+
+	/* Hybrid: mostly in the wheel, with the overflow. */
+	ttimer_geometry_run(6, 2, TTIMER_HYBRID);
+	ttimer_geometry_run(8, 3, TTIMER_HYBRID);
+}
+
+static void
+ttimer_range(void)
+{
+	const unsigned nent = 1024;
+	ttimer_ref_t ent[nent];
+	time_t fired[nent], lo[nent], hi[nent], start;
+	ttimer_t *timer;
+	time_t next;
+
+	curtime = 0;
+	timer = ttimer_create(0, curtime);
+	assert(timer);
+
+	for (unsigned i = 0; i < nent; i++) {
+		fired[i] = 0;
+		ttimer_setfunc(&ent[i], time_handler, &fired[i]);
+	}
+
+	/* Joins the occupied bucket; otherwise, the aligned tick. */
+	ttimer_start(timer, &ent[0], 100);
+	ttimer_start_range(timer, &ent[1], 90, 110);
+	ttimer_start_range(timer, &ent[2], 1000, 2000);
+	ttimer_start_range(timer, &ent[3], 1010, 1500);
+	ttimer_start_range(timer, &ent[4], 5, 5);
+	while (curtime < 200) {
+		ttimer_run_ticks(timer, ++curtime);
+	}
+	assert(fired[0] == 100 && fired[1] == 100 && fired[4] == 5);
+
+	/* The range of the buckets wraps around. */
+	ttimer_start(timer, &ent[5], 90);
+	ttimer_start_range(timer, &ent[6], 40, 100);
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+	assert(fired[2] == 1024 && fired[3] == 1024);
+	assert(fired[5] == 290 && fired[6] == 290);
+
+	/* Joins the occupied bucket of a higher level, at its tick. */
+	start = curtime;
+	ttimer_start(timer, &ent[7], 5000);
+	ttimer_start_range(timer, &ent[8], 4900, 6000);
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+	assert(fired[7] == start + 5000 && fired[8] == start + 5000);
+
+	/* Random ranges: always within the range. */
+	for (unsigned i = 0; i < nent; i++) {
+		const time_t min = (random() % 100000) + 1;
+
+		lo[i] = curtime + min;
+		hi[i] = lo[i] + (random() % (min / 4 + 1));
+		fired[i] = 0;
+		ttimer_start_range(timer, &ent[i], lo[i] - curtime,
+		    hi[i] - curtime);
+	}
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(fired[i] >= lo[i] && fired[i] <= hi[i]);
+	}
+	ttimer_destroy(timer);
+}
+
+/*
+ * run_until_idle: drain the remaining timers, jumping from one event
+ * to the next.
+ */
+static void
+run_until_idle(ttimer_t *timer)
+{
+	time_t next;
+
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+}
+
+/*
+ * assert_all_fired: every entry has either fired exactly at its
+ * deadline, see deadline_handler(), or has been stopped.
+ */
+static void
+assert_all_fired(const ttimer_ref_t *ent, const time_t *deadline, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++) {
+		assert(!ent[i].scheduled && deadline[i] == 0);
+	}
+}
+
+/*
+ * The randomised driver: the operation on a random entry each round,
+ * with the time ticking and jumping in turns.  The rest is drained at
+ * the end and every entry must have fired exactly at its deadline.
+ * It is run with each of the wheel variants.
+ */
+typedef struct {
+	ttimer_t *	timer;
+	ttimer_ref_t *	ent;
+	time_t *	deadline;
+	unsigned	nent;
+	void *		arg;
+} driver_t;
+
+typedef struct {
+	unsigned	nent;
+	unsigned	rounds;
+	/* Optional: set up the entry, after ttimer_setfunc(). */
+	void		(*setup)(driver_t *, unsigned);
+	void		(*op)(driver_t *, unsigned);
+	/* Optional: check the state after the drain. */
+	void		(*check)(driver_t *);
+} driver_ops_t;
+
+static const unsigned driver_flags[] = {
+	0, TTIMER_INCREMENTAL, TTIMER_HASHED, TTIMER_HYBRID
+};
+
+static void
+driver_step(driver_t *d, unsigned round)
+{
+	time_t next;
+
+	if (round % 2) {
+		ttimer_run_ticks(d->timer, ++curtime);
+	} else if ((next = ttimer_next_expiry(d->timer)) > 0) {
+		curtime += (next < 10) ? next : 10;
+		ttimer_run_ticks(d->timer, curtime);
+	}
+}
+
+static void
+driver_run(const driver_ops_t *ops, void *arg)
+{
+	const unsigned nflags = sizeof(driver_flags) / sizeof(driver_flags[0]);
+
+	for (unsigned f = 0; f < nflags; f++) {
+		driver_t d;
+
+		curtime = 0;
+		d.timer = ttimer_create_flags(0, curtime, driver_flags[f]);
+		d.ent = calloc(ops->nent, sizeof(ttimer_ref_t));
+		d.deadline = calloc(ops->nent, sizeof(time_t));
+		d.nent = ops->nent;
+		d.arg = arg;
+		assert(d.timer && d.ent && d.deadline);
+
+		for (unsigned i = 0; i < d.nent; i++) {
+			ttimer_setfunc(&d.ent[i], deadline_handler,
+			    &d.deadline[i]);
+			if (ops->setup) {
+				ops->setup(&d, i);
+			}
+		}
+		for (unsigned round = 0; round < ops->rounds; round++) {
+			ops->op(&d, random() % d.nent);
+			driver_step(&d, round);
+		}
+		run_until_idle(d.timer);
+		assert_all_fired(d.ent, d.deadline, d.nent);
+		if (ops->check) {
+			ops->check(&d);
+		}
+		ttimer_destroy(d.timer);
+		free(d.deadline);
+		free(d.ent);
+	}
+}
+
+/*
+ * Re-arm the timers (both active and not), mostly by a little,
+ * as the per-packet timers are; sometimes stop them.
+ */
+static void
+restart_op(driver_t *d, unsigned i)
+{
+	time_t timeout;
+
+	switch (random() % 8) {
+	case 0:
+		ttimer_stop(d->timer, &d->ent[i]);
+		d->deadline[i] = 0;
+		return;
+	case 1:
+		timeout = (random() % (1 << 22)) + 1;
+		break;
+	default:
+		timeout = (random() % 5000) + 1;
+		break;
+	}
+	d->deadline[i] = curtime + timeout;
+	ttimer_restart(d->timer, &d->ent[i], timeout);
+}
+
+static const driver_ops_t restart_ops = {
+	.nent = 512, .rounds = 50000, .op = restart_op,
+};
+
+static void
+ttimer_restart_basic(void)
+{
+	ttimer_t *timer;
+	ttimer_ref_t ent;
+	unsigned slot;
+	time_t fired = 0;
+
+	/* Within the same bucket of the second level: not moved. */
+	curtime = 0;
+	timer = ttimer_create(0, curtime);
+	assert(timer);
+	ttimer_setfunc(&ent, time_handler, &fired);
+	ttimer_start(timer, &ent, 1000);
+	slot = ent.slot;
+	ttimer_restart(timer, &ent, 1010);
+	assert(ent.scheduled && ent.slot == slot);
+	ttimer_restart(timer, &ent, 2000);
+	assert(ent.scheduled && ent.slot != slot);
+	ttimer_restart(timer, &ent, 1005);
+	while ((curtime = curtime + 1) <= 2000) {
+		ttimer_run_ticks(timer, curtime);
+	}
+	assert(!ent.scheduled && fired == 1005);
+	ttimer_destroy(timer);
+
+	driver_run(&restart_ops, NULL);
+}
+
+/*
+ * Extend the timers, mostly pushing them back a little as the
+ * idle timers are; sometimes bring them earlier or stop them.
+ */
+static void
+extend_op(driver_t *d, unsigned i)
+{
+	time_t timeout;
+
+	switch (random() % 8) {
+	case 0:
+		ttimer_stop(d->timer, &d->ent[i]);
+		d->deadline[i] = 0;
+		return;
+	case 1:
+		timeout = (random() % (1 << 22)) + 1;
+		break;
+	default:
+		timeout = (random() % 600) + 1;
+		if (d->deadline[i] > curtime + timeout) {
+			timeout = d->deadline[i] - curtime;
+		}
+		break;
+	}
+	d->deadline[i] = curtime + timeout;
+	ttimer_extend(d->timer, &d->ent[i], timeout);
+}
+
+static const driver_ops_t extend_ops = {
+	.nent = 512, .rounds = 50000, .op = extend_op,
+};
+
+static void
+ttimer_extend_basic(void)
+{
+	ttimer_t *timer;
+	ttimer_ref_t ent;
+	unsigned slot;
+	time_t fired = 0;
+
+	/* Extending does not move the entry; it fires once, late. */
+	curtime = 0;
+	timer = ttimer_create(0, curtime);
+	assert(timer);
+	ttimer_setfunc(&ent, time_handler, &fired);
+	ttimer_extend(timer, &ent, 10);
+	for (unsigned i = 0; i < 1000; i++) {
+		slot = ent.slot;
+		ttimer_extend(timer, &ent, 10);
+		assert(ent.scheduled && ent.slot == slot);
+		ttimer_run_ticks(timer, ++curtime);
+	}
+	assert(fired == 0);
+	while (ent.scheduled) {
+		ttimer_run_ticks(timer, ++curtime);
+	}
+	assert(fired == 1009 && curtime == 1009);
+	ttimer_destroy(timer);
+
+	driver_run(&extend_ops, NULL);
+}
+
+typedef struct {
+	ttimer_t *	timer;
+	time_t		start;
+	time_t		period;
+	unsigned	count;
+	unsigned	limit;
+} periodic_t;
+
+static void
+periodic_handler(ttimer_ref_t *ent, void *arg)
+{
+	periodic_t *p = arg;
+
+	/* Re-armed already, with no drift. */
+	assert(ent->scheduled);
+	assert(curtime == p->start + (time_t)++p->count * p->period);
+	if (p->count == p->limit) {
+		assert(ttimer_stop(p->timer, ent));
+	}
+}
+
+static void
+ttimer_periodic_run(unsigned flags)
+{
+	const unsigned nent = 256;
+	ttimer_ref_t ent[nent];
+	periodic_t per[nent];
+	ttimer_t *timer;
+	time_t next;
+
+	curtime = 0;
+	timer = ttimer_create_flags(0, curtime, flags);
+	assert(timer);
+
+	for (unsigned i = 0; i < nent; i++) {
+		per[i].timer = timer;
+		per[i].start = curtime;
+		per[i].period = (i % 4) ? (random() % 300) + 1 :
+		    (random() % 100000) + 1;
+		per[i].count = 0;
+		per[i].limit = (random() % 50) + 1;
+		ttimer_setfunc(&ent[i], periodic_handler, &per[i]);
+		ttimer_start_periodic(timer, &ent[i], per[i].period);
+	}
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(!ent[i].scheduled && per[i].count == per[i].limit);
+	}
+	ttimer_destroy(timer);
+}
+
+static void
+ttimer_periodic(void)
+{
+	ttimer_t *timer;
+	ttimer_ref_t ent;
+	periodic_t per;
+
+	/* Every tick: does not land in the bucket being processed. */
+	curtime = 0;
+	timer = ttimer_create(0, curtime);
+	assert(timer);
+	per = (periodic_t){ timer, curtime, 1, 0, 1000 };
+	ttimer_setfunc(&ent, periodic_handler, &per);
+	ttimer_start_periodic(timer, &ent, 1);
+	for (unsigned i = 0; i < 1000; i++) {
+		curtime++;
+		ttimer_tick(timer);
+		assert(per.count == i + 1);
+	}
+	assert(!ent.scheduled);
+	ttimer_destroy(timer);
+
+	ttimer_periodic_run(0);
+	ttimer_periodic_run(TTIMER_INCREMENTAL);
+	ttimer_periodic_run(TTIMER_HASHED);
+	ttimer_periodic_run(TTIMER_HYBRID);
+}
+
+/*
+ * The remaining time, of the absolute deadlines, is exact; also once
+ * extended.
+ */
+static void
+deadline_op(driver_t *d, unsigned i)
+{
+	if (d->ent[i].scheduled) {
+		assert(ttimer_expires_in(d->timer, &d->ent[i]) ==
+		    d->deadline[i] - curtime);
+	} else {
+		assert(ttimer_expires_in(d->timer, &d->ent[i]) == -1);
+		d->deadline[i] = curtime + (random() % 100000) + 1;
+		ttimer_start_at(d->timer, &d->ent[i], d->deadline[i]);
+	}
+	if ((random() % 4) == 0) {
+		d->deadline[i] += random() % 1000;
+		ttimer_extend(d->timer, &d->ent[i], d->deadline[i] - curtime);
+	}
+	assert(ttimer_expires_in(d->timer, &d->ent[i]) ==
+	    d->deadline[i] - curtime);
+}
+
+static const driver_ops_t deadline_ops = {
+	.nent = 512, .rounds = 20000, .op = deadline_op,
+};
+
+static void
+ttimer_deadline(void)
+{
+	ttimer_t *timer;
+	ttimer_ref_t ent;
+	time_t fired = 0;
+
+	/* The deadline in the past: expires on the next tick. */
+	curtime = 1000;
+	timer = ttimer_create(0, curtime);
+	assert(timer);
+	ttimer_setfunc(&ent, time_handler, &fired);
+	ttimer_start_at(timer, &ent, 500);
+	assert(ttimer_expires_in(timer, &ent) == 1);
+	ttimer_run_ticks(timer, ++curtime);
+	assert(fired == 1001 && ttimer_expires_in(timer, &ent) == -1);
+
+	/* Also when the ticks are run one by one. */
+	for (unsigned i = 0; i < 10; i++) {
+		ttimer_tick(timer);
+	}
+	ttimer_start_at(timer, &ent, 1021);
+	assert(ttimer_expires_in(timer, &ent) == 10);
+	ttimer_destroy(timer);
+
+	driver_run(&deadline_ops, NULL);
+}
+
+/*
+ * The batches over a run of the entries: runs of the same timeout,
+ * some beyond the range; then stop a part and re-start another.
+ */
+static void
+batch_op(driver_t *d, unsigned i)
+{
+	const unsigned nbatch = 64;
+	const unsigned end = (d->nent - i > nbatch) ? i + nbatch : d->nent;
+	ttimer_ref_t *vec[nbatch];
+	time_t timeouts[nbatch];
+	size_t n = 0;
+
+	for (unsigned j = i; j < end; j++) {
+		if (d->ent[j].scheduled) {
+			continue;
+		}
+		if (n == 0 || (random() % 16) == 0) {
+			timeouts[n] = (random() % 8) ?
+			    (random() % 70000) + 1 :
+			    (random() % (1 << 25)) + 1;
+		} else {
+			timeouts[n] = timeouts[n - 1];
+		}
+		d->deadline[j] = curtime + timeouts[n];
+		vec[n++] = &d->ent[j];
+	}
+	ttimer_start_batch(d->timer, vec, timeouts, n);
+
+	n = 0;
+	for (unsigned j = i; j < end; j += 7) {
+		d->deadline[j] = d->ent[j].scheduled ? 0 : d->deadline[j];
+		vec[n++] = &d->ent[j];
+	}
+	(void)ttimer_stop_batch(d->timer, vec, n);
+	assert(ttimer_stop_batch(d->timer, vec, n) == 0);
+
+	n = 0;
+	for (unsigned j = i + 3; j < end; j += 5) {
+		timeouts[n] = (random() % 5000) + 1;
+		d->deadline[j] = curtime + timeouts[n];
+		vec[n++] = &d->ent[j];
+	}
+	ttimer_restart_batch(d->timer, vec, timeouts, n);
+}
+
+static const driver_ops_t batch_ops = {
+	.nent = 4096, .rounds = 2000, .op = batch_op,
+};
+
+static void
+ttimer_batch(void)
+{
+	const unsigned nent = 1000;
+	const time_t idle[] = { 30, 5000, 300000 };
+	ttimer_ref_t *ents, *vec[nent];
+	time_t fired[nent], timeouts[nent];
+	ttimer_t *timer;
+
+	ents = calloc(nent, sizeof(ttimer_ref_t));
+	assert(ents);
+
+	/*
+	 * A storm of the interleaved idle timeouts, spanning a few chunks:
+	 * every entry expires exactly on time.
+	 */
+	curtime = 0;
+	timer = ttimer_create(0, curtime);
+	assert(timer);
+	for (unsigned i = 0; i < nent; i++) {
+		fired[i] = 0;
+		ttimer_setfunc(&ents[i], time_handler, &fired[i]);
+		timeouts[i] = idle[i % 3];
+		vec[i] = &ents[i];
+	}
+	ttimer_start_batch(timer, vec, timeouts, nent);
+	for (unsigned i = 0; i < nent; i++) {
+		assert(ttimer_expires_in(timer, &ents[i]) == timeouts[i]);
+	}
+
+	/* Re-start: the short ones in place, the rest moved. */
+	for (unsigned i = 0; i < nent; i++) {
+		timeouts[i] = (i % 3) ? idle[(i + 1) % 3] : 20;
+	}
+	ttimer_restart_batch(timer, vec, timeouts, nent);
+	for (unsigned i = 0; i < nent; i++) {
+		assert(ttimer_expires_in(timer, &ents[i]) == timeouts[i]);
+	}
+
+	while (curtime < 300000) {
+		ttimer_run_ticks(timer, ++curtime);
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(fired[i] == timeouts[i]);
+		assert(ttimer_expires_in(timer, &ents[i]) == -1);
+	}
+	ttimer_destroy(timer);
+	free(ents);
+
+	driver_run(&batch_ops, NULL);
+}
+
+static const unsigned	ngroups = 16;
+
+static void
+group_setup(driver_t *d, unsigned i)
+{
+	ttimer_group_t *group = d->arg;
+
+	/* Initialised for each run, along with the first entries. */
+	if (i < ngroups) {
+		ttimer_group_init(&group[i]);
+	}
+	ttimer_setgroup(&d->ent[i], &group[i % ngroups]);
+}
+
+static void
+group_op(driver_t *d, unsigned i)
+{
+	const time_t timeout = (random() % 5000) + 1;
+
+	if ((random() % 512) == 0) {
+		/* Cancel the group of the entry. */
+		ttimer_group_cancel(d->ent[i].group);
+		for (unsigned j = i % ngroups; j < d->nent; j += ngroups) {
+			d->deadline[j] = 0;
+			assert(ttimer_expires_in(d->timer, &d->ent[j]) == -1);
+		}
+	} else if (d->deadline[i]) {
+		assert(ttimer_stop(d->timer, &d->ent[i]));
+		d->deadline[i] = 0;
+	} else {
+		/* Note: the entry may be cancelled, yet linked. */
+		d->deadline[i] = curtime + timeout;
+		ttimer_start(d->timer, &d->ent[i], timeout);
+	}
+}
+
+static void
+group_check(driver_t *d)
+{
+	ttimer_group_t *group = d->arg;
+
+	for (unsigned g = 0; g < ngroups; g++) {
+		assert(ttimer_group_pending(&group[g]) == 0);
+	}
+}
+
+static const driver_ops_t group_ops = {
+	.nent = 1024, .rounds = 50000, .setup = group_setup,
+	.op = group_op, .check = group_check,
+};
+
+static void
+ttimer_group(void)
+{
+	ttimer_group_t group, groups[ngroups];
+	ttimer_ref_t ent[8];
+	ttimer_t *timer;
+	time_t fired = 0;
+
+	/* Cancelled in one go: the handlers are not called. */
+	curtime = 0;
+	timer = ttimer_create(0, curtime);
+	assert(timer);
+	ttimer_group_init(&group);
+	for (unsigned i = 0; i < 8; i++) {
+		ttimer_setfunc(&ent[i], time_handler, &fired);
+		ttimer_setgroup(&ent[i], &group);
+		ttimer_start(timer, &ent[i], (i + 1) * 100);
+	}
+	assert(ttimer_group_pending(&group) == 8);
+	ttimer_group_cancel(&group);
+	assert(ttimer_expires_in(timer, &ent[0]) == -1);
+	assert(!ttimer_stop(timer, &ent[7]));
+	assert(ttimer_group_pending(&group) == 7);
+
+	/* Re-started after the cancellation: active again. */
+	ttimer_start(timer, &ent[0], 1000);
+	assert(ttimer_expires_in(timer, &ent[0]) == 1000);
+	while (ttimer_next_expiry(timer) != -1) {
+		ttimer_run_ticks(timer, ++curtime);
+	}
+	assert(fired == 1000 && ttimer_group_pending(&group) == 0);
+
+	/* Discarded once their bucket is cascaded, before the expiry. */
+	for (unsigned i = 0; i < 8; i++) {
+		ttimer_start(timer, &ent[i], 100000 + i);
+	}
+	ttimer_group_cancel(&group);
+	curtime += 70000;
+	ttimer_run_ticks(timer, curtime);
+	assert(ttimer_group_pending(&group) == 0);
+	assert(ttimer_next_expiry(timer) == -1 && fired == 1000);
+	ttimer_destroy(timer);
+
+	driver_run(&group_ops, groups);
+}
+
+static void
+fail_handler(ttimer_ref_t *ent, void *arg)
+{
+	/* Must never fire. */
+	assert(0);
+	(void)ent;
+	(void)arg;
+}
+
+static void
+drain_handler(ttimer_ref_t *ent, void *arg)
+{
+	unsigned *drained = arg;
+
+	assert(!ent->scheduled);
+	drained[(uintptr_t)ent->arg]++;
+}
+
+static void
+ttimer_drain_run(unsigned flags)
+{
+	const unsigned nent = 2048;
+	ttimer_ref_t ent[nent];
+	unsigned drained[nent];
+	ttimer_group_t group;
+	ttimer_t *timer;
+
+	curtime = 0;
+	timer = ttimer_create_flags(0, curtime, flags);
+	assert(timer);
+	ttimer_group_init(&group);
+
+	/*
+	 * Across the levels, beyond the range and the cancelled group;
+	 * none of them is due before the destruction.
+	 */
+	for (unsigned i = 0; i < nent; i++) {
+		const time_t timeout = 1000 + ((random() % 2) ?
+		    (random() % 70000) + 1 : (random() % (1 << 26)) + 1);
+
+		drained[i] = 0;
+		ttimer_setfunc(&ent[i], fail_handler, (void *)(uintptr_t)i);
+		if ((i % 8) == 0) {
+			ttimer_setgroup(&ent[i], &group);
+		}
+		ttimer_start(timer, &ent[i], timeout);
+	}
+	ttimer_group_cancel(&group);
+	for (unsigned i = 0; i < 1000; i++) {
+		ttimer_run_ticks(timer, ++curtime);
+	}
+	ttimer_destroy_drain(timer, drain_handler, drained);
+
+	for (unsigned i = 0; i < nent; i++) {
+		assert(!ent[i].scheduled);
+		assert(drained[i] == ((i % 8) != 0));
+	}
+	assert(ttimer_group_pending(&group) == 0);
+}
+
+static void
+ttimer_drain(void)
+{
+	ttimer_drain_run(0);
+	ttimer_drain_run(TTIMER_INCREMENTAL);
+	ttimer_drain_run(TTIMER_HASHED);
+	ttimer_drain_run(TTIMER_HYBRID);
+}
+
+static void
+handle_handler(ttimer_ref_t *ent, void *arg)
+{
+	ttimer_handle_t *handles = arg;
+	const ttimer_handle_t h = ttimer_handle_get(ent);
+
+	/* The handle is found using the entry. */
+	assert(h == handles[0] || h == handles[1]);
+	handles[h == handles[0] ? 0 : 1] = 0;
+}
+
+static void
+ttimer_handle(void)
+{
+	const unsigned nent = 5000;
+	ttimer_handle_t *h = calloc(nent, sizeof(ttimer_handle_t));
+	ttimer_handle_t pair[2], stale;
+	unsigned fired = 0, nstopped = 0;
+	ttimer_t *timer;
+
+	curtime = 0;
+	timer = ttimer_create(0, curtime);
+	assert(timer && h);
+	assert(ttimer_handle_ref(timer, 0) == NULL);
+
+	/* The handler finds the handle of the entry. */
+	pair[0] = ttimer_handle_alloc(timer, handle_handler, pair);
+	pair[1] = ttimer_handle_alloc(timer, handle_handler, pair);
+	assert(pair[0] && pair[1] && pair[0] != pair[1]);
+	assert(ttimer_handle_start(timer, pair[0], 10));
+	assert(!ttimer_handle_start(timer, pair[0], 10));
+	assert(ttimer_handle_start(timer, pair[1], 11));
+	while (curtime < 11) {
+		ttimer_run_ticks(timer, ++curtime);
+	}
+	assert(pair[0] == 0 && pair[1] == 0);
+
+	/* Across several slabs; the released handles are stale. */
+	for (unsigned i = 0; i < nent; i++) {
+		h[i] = ttimer_handle_alloc(timer, count_handler, &fired);
+		assert(h[i] != 0);
+		assert(ttimer_handle_start(timer, h[i], (i % 100) + 1));
+	}
+	for (unsigned i = 0; i < nent; i += 2) {
+		assert(ttimer_handle_free(timer, h[i]));
+		assert(!ttimer_handle_free(timer, h[i]));
+		assert(!ttimer_handle_start(timer, h[i], 1));
+		assert(!ttimer_handle_stop(timer, h[i]));
+		assert(!ttimer_handle_restart(timer, h[i], 1));
+		assert(ttimer_handle_ref(timer, h[i]) == NULL);
+	}
+
+	/* Re-used entries get the new handles. */
+	stale = h[0];
+	h[0] = ttimer_handle_alloc(timer, count_handler, &fired);
+	assert(h[0] != stale && ttimer_handle_ref(timer, stale) == NULL);
+	assert(ttimer_handle_ref(timer, h[0]) != NULL);
+	assert(ttimer_handle_free(timer, h[0]));
+
+	for (unsigned i = 1; i < nent; i += 2) {
+		if (i % 3) {
+			assert(ttimer_handle_restart(timer, h[i], 1000));
+		} else {
+			assert(ttimer_handle_stop(timer, h[i]));
+			nstopped++;
+		}
+	}
+	curtime += 1000;
+	ttimer_run_ticks(timer, curtime);
+	assert(fired == (nent / 2) - nstopped);
+	ttimer_destroy(timer);
+	free(h);
+}
+
+/*
+ * ttimer_hybrid: the population of the timers goes up and down across
+ * the marks, so that the entries migrate between the heap and the wheel.
+ */
+static void
+ttimer_hybrid(void)
+{
+	const unsigned nent = 512;
+	ttimer_ref_t ent[nent];
+	time_t deadline[nent];
+	ttimer_t *timer;
+	time_t next;
+
+	curtime = 0;
+	timer = ttimer_create_flags(0, curtime, TTIMER_HYBRID);
+	assert(timer);
+
+	for (unsigned i = 0; i < nent; i++) {
+		deadline[i] = 0;
+		ttimer_setfunc(&ent[i], deadline_handler, &deadline[i]);
+	}
+	for (unsigned phase = 0; phase < 8; phase++) {
+		const unsigned target = (phase % 2) ? 8 : 300;
+		time_t earliest = -1;
+
+		for (unsigned round = 0; round < 3000; round++) {
+			const unsigned i = random() % nent;
+			const time_t timeout = (random() % 8) ?
+			    (random() % 3000) + 1 : (random() % (1 << 25)) + 1;
+			unsigned nactive = 0;
+
+			for (unsigned j = 0; j < nent; j++) {
+				nactive += ent[j].scheduled;
+			}
+			if (ent[i].scheduled && (nactive > target ||
+			    (random() % 4) == 0)) {
+				assert(ttimer_stop(timer, &ent[i]));
+				deadline[i] = 0;
+			} else if (!ent[i].scheduled && nactive < target) {
+				deadline[i] = curtime + timeout;
+				ttimer_start(timer, &ent[i], timeout);
+			}
+			if (round % 2) {
+				ttimer_run_ticks(timer, ++curtime);
+			} else if ((next = ttimer_next_expiry(timer)) > 0) {
+				curtime += (next < 100) ? next : 100;
+				ttimer_run_ticks(timer, curtime);
+			}
+		}
+
+		/* A few timers: the next expiry is exact. */
+		for (unsigned i = 0; i < nent; i++) {
+			if (ent[i].scheduled && (earliest == -1 ||
+			    deadline[i] < earliest)) {
+				earliest = deadline[i];
+			}
+		}
+		if (target < 32) {
+			next = ttimer_next_expiry(timer);
+			assert(earliest == -1 || next == earliest - curtime);
+		}
+	}
+	while ((next = ttimer_next_expiry(timer)) != -1) {
+		curtime += next;
+		ttimer_run_ticks(timer, curtime);
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(!ent[i].scheduled && deadline[i] == 0);
+	}
+	ttimer_destroy(timer);
+}
+
+static void
+arena_handler(ttimer_arena_t *arena, uint32_t idx, void *arg)
+{
+	time_t *deadline = arg;
+
+	assert(!ttimer_arena_scheduled(arena, idx));
+	assert(deadline[idx] == curtime);
+	deadline[idx] = 0;
+}
+
+static void
+ttimer_arena(void)
+{
+	const unsigned nent = 4096;
+	time_t *deadline = calloc(nent, sizeof(time_t));
+	ttimer_arena_t *arena;
+	time_t next;
+
+	curtime = 0;
+	assert(ttimer_arena_create(0, curtime) == NULL);
+	arena = ttimer_arena_create(nent, curtime);
+	assert(arena && deadline);
+
+	ttimer_arena_sethandler(arena, 1, arena_handler, deadline);
+	for (unsigned i = 0; i < nent; i++) {
+		ttimer_arena_setfunc(arena, i, 1);
+	}
+
+	/* Beyond the range: rejected. */
+	assert(!ttimer_arena_start(arena, 0, (time_t)UINT32_MAX + 1));
+	assert(!ttimer_arena_scheduled(arena, 0));
+
+	/* Random starts and stops, including beyond the range. */
+	for (unsigned round = 0; round < 50000; round++) {
+		const unsigned i = random() % nent;
+		const time_t timeout = (random() % 2) ?
+		    (random() % 5000) + 1 : (random() % (1 << 26)) + 1;
+
+		if (ttimer_arena_scheduled(arena, i)) {
+			assert(ttimer_arena_stop(arena, i));
+			deadline[i] = 0;
+		} else {
+			assert(!ttimer_arena_stop(arena, i));
+			deadline[i] = curtime + timeout;
+			assert(ttimer_arena_start(arena, i, timeout));
+		}
+		if (round % 2) {
+			ttimer_arena_run_ticks(arena, ++curtime);
+		} else if ((next = ttimer_arena_next_expiry(arena)) > 0) {
+			curtime += next;
+			ttimer_arena_run_ticks(arena, curtime);
+		}
+	}
+	while ((next = ttimer_arena_next_expiry(arena)) != -1) {
+		curtime += next;
+		ttimer_arena_run_ticks(arena, curtime);
+	}
+	for (unsigned i = 0; i < nent; i++) {
+		assert(!ttimer_arena_scheduled(arena, i) && deadline[i] == 0);
+	}
+	ttimer_arena_destroy(arena);
+	free(deadline);
+}
+
+static void
+ttimer_slab(void)
+{
+	const unsigned nent = 10000;
+	ttimer_ref_t **ents = calloc(nent, sizeof(ttimer_ref_t *));
+	unsigned fired = 0;
+	ttimer_t *timer;
+
+	timer = ttimer_create(0, 0);
+	assert(timer && ents);
+
+	/* Allocate across several slabs; they must be distinct. */
+	for (unsigned i = 0; i < nent; i++) {
+		ents[i] = ttimer_ref_alloc(timer);
+		assert(ents[i] && !ents[i]->scheduled);
+		ttimer_setfunc(ents[i], count_handler, &fired);
+		ttimer_start(timer, ents[i], (i % 1000) + 1);
+	}
+	for (unsigned i = 1; i < nent; i++) {
+		assert(ents[i] != ents[i - 1]);
+	}
+
+	/* Free every other (active) entry and re-use them. */
+	for (unsigned i = 0; i < nent; i += 2) {
+		ttimer_ref_free(timer, ents[i]);
+	}
+	for (unsigned i = 0; i < nent; i += 2) {
+		ents[i] = ttimer_ref_alloc(timer);
+		assert(ents[i] && !ents[i]->scheduled);
+	}
+	ttimer_run_ticks(timer, 1000);
+	assert(fired == nent / 2);
+
+	/* The remaining entries are released with the timer. */
+	ttimer_destroy(timer);
+	free(ents);
+}
+
 int
 main(void)
 {
 	ttimer_basic();
 	ttimer_overflow();
 	ttimer_random();
+	ttimer_catchup();
+	ttimer_fastforward();
+	ttimer_expiry();
+	ttimer_tickless();
+	ttimer_bounded();
+	ttimer_batch_collect();
+	ttimer_cascade();
+	ttimer_incremental();
+	ttimer_approx();
+	ttimer_longterm();
+	ttimer_geometry();
+	ttimer_arena();
+	ttimer_slab();
+	ttimer_hybrid();
+	ttimer_range();
+	ttimer_restart_basic();
+	ttimer_extend_basic();
+	ttimer_periodic();
+	ttimer_deadline();
+	ttimer_batch();
+	ttimer_group();
+	ttimer_drain();
+	ttimer_handle();
 	puts("ok");
 	return 0;
 }
@@ -28,6 +28,8 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 
@@ -35,140 +37,2123 @@
 #include "utils.h"
 
 /*
- * Each timing wheel in the hierarchy will be of equal size: 256 slots.
- * It is a convenient number for calculations.  Three levels of 256-slot
- * wheels is 256^3 = ~194 days.  Just cap the maximum level at 3 and let
- * the re-calculation happen for the greater values.
+ * Each timing wheel in the hierarchy will be of equal size: 256 slots by
+ * default.  It is a convenient number for calculations.  Three levels of
+ * 256-slot wheels is 256^3 = ~194 days.  Just cap the maximum level at 3
+ * and let the overflow heap take the greater values.
+ *
+ * The geometry can be chosen using ttimer_create_ex(): 2^bits slots per
+ * wheel, within the limits below, and the number of levels.
+ */
+
+#define	WHEEL_BITS		(8)
+#define	WHEEL_MAX_LEVELS	(3)
+
+#define	WHEEL_MIN_BITS		(4)
+#define	WHEEL_MAX_BITS		(16)
+#define	WHEEL_LIMIT_LEVELS	(32)
+
+/*
+ * Approximate mode (TTIMER_APPROX): the granularity of each level is
+ * only 2^3 = 8 times coarser than the level below, rather than 256.
+ * The entries are placed in the bucket rounded up to the granularity
+ * of the level and they expire straight from it, i.e. there is no
+ * cascading.  The expiry is late by less than the granularity of the
+ * level, i.e. 2^(3 * level) ticks:
+ *
+ *	level	timeouts (ticks)	late by at most
+ *	0	1 .. 255		0 (exact)
+ *	1	256 .. ~2K		7
+ *	2	~2K .. ~16K		63
+ *	3	~16K .. ~130K		511
+ *	4	~130K .. ~1M		4095
+ *	5	~1M .. ~8.4M		32767
+ *	6	~8.4M .. ~67M		262143
+ *
+ * Hence, the error is at most 8/256 (about 3%) of the timeout.  Seven
+ * levels cover the range comparable to the three levels in the normal
+ * mode.  With a custom geometry, the error is 8/2^bits of the timeout.
+ */
+#define	WHEEL_APPROX_BITS	(3)
+#define	WHEEL_APPROX_LEVELS	(7)
+
+#define	WHEEL_BUCKETS(t)	(1U << (t)->bits)
+#define	DIV_BY_BUCKETS(t, x)	((x) >> (t)->bits)
+#define	MOD_BY_BUCKETS(t, x)	((x) & (WHEEL_BUCKETS(t) - 1))
+
+/*
+ * Each level has an occupancy bitmap with a bit per bucket, so that
+ * the empty buckets can be skipped without touching their list heads.
+ */
+#define	WHEEL_WORDS(t)		((WHEEL_BUCKETS(t) + 63) / 64)
+
+typedef LIST_HEAD(ttimer_list, ttimer_ref) ttimer_list_t;
+
+/*
+ * The arrays of all levels are allocated together with the timer,
+ * following the wheel structures, see ttimer_create_ex().
+ */
+typedef struct {
+	uint64_t *		bitmap;
+	ttimer_list_t *		bucket;
+
+	/*
+	 * Incremental cascading: the number of entries in each bucket
+	 * and the entries set aside from the bucket to be drained next,
+	 * since they are due in its next lap.  See twheel_migrate().
+	 */
+	ttimer_list_t		lapped;
+	unsigned *		count;
+} twheel_t;
+
+/*
+ * The clock is the number of ticks since the creation of the timer.
+ * The hands of the wheels are not stored: the hand of a level is the
+ * corresponding "digit" of the clock, see TWHEEL_HAND().  Therefore,
+ * moving the clock forward moves all hands at once.
+ *
+ * => The unit of a level is 2^(level * lvlbits) ticks: the "digits"
+ *    are WHEEL_BITS wide normally; they overlap in the approximate mode.
+ */
+#define	TWHEEL_SHIFT(t, l)	((l) * (t)->lvlbits)
+#define	TWHEEL_HAND(t, c, l)	MOD_BY_BUCKETS(t, (c) >> TWHEEL_SHIFT(t, l))
+
+/*
+ * The slot of the entries which are expired, but their handlers are
+ * still pending (i.e. the entries are on the expired list).  The other
+ * special value is used internally, when cascading.
+ */
+#define	TTIMER_SLOT_EXPIRED	UINT_MAX
+#define	TTIMER_SLOT_RESCHED	(UINT_MAX - 1)
+
+/*
+ * The slot of the entries in the overflow heap: the flag and the index
+ * in the heap.  Note: the special values above have the flag set too.
+ */
+#define	TTIMER_SLOT_HEAP	(1U << 31)
+#define	TTIMER_HEAP_IDX(s)	((s) & ~TTIMER_SLOT_HEAP)
+#define	TTIMER_HEAP_MINSIZE	(16)
+
+/*
+ * Hybrid mode (TTIMER_HYBRID): while there are only a few timers, all
+ * entries are kept in the heap, ordered by the expiry time, and the wheel
+ * is not touched at all.  Once the number of the active timers exceeds
+ * the high mark, they are moved to the wheel; they are moved back to the
+ * heap once the number drops below the low mark.  The gap between the
+ * marks avoids the migration back and forth on every start and stop.
+ */
+#define	TTIMER_HYBRID_HIGH	(128)
+#define	TTIMER_HYBRID_LOW	(32)
+
+/*
+ * The batch operations prefetch the entries this far ahead.  The started
+ * entries are grouped by their target bucket in chunks of this many.
+ */
+#define	TTIMER_BATCH_PREFETCH	(8)
+#define	TTIMER_BATCH_CHUNK	(256)
+
+/*
+ * The slabs of the entries allocated by the timer (ttimer_ref_alloc),
+ * so that they are contiguous in memory.  The slabs are aligned to their
+ * size and kept until the timer is destroyed.  The slab starts with its
+ * index in the timer, so that the handle of the entry can be found, and
+ * the magic value to catch the entries which are not in a slab.  The
+ * generations of the handles are kept aside, in the slab, so that the
+ * entries themselves do not carry them.
+ */
+#define	TTIMER_SLAB_SIZE	(64 * 1024)
+#define	TTIMER_SLAB_MAX		(1U << 16)
+#define	TTIMER_SLAB_MAGIC	(0x51ab7e77U)
+
+/* Note: the header is padded to 16 bytes for the alignment. */
+#define	TTIMER_SLAB_ENTS	\
+    ((TTIMER_SLAB_SIZE - 16) / (sizeof(ttimer_ref_t) + sizeof(unsigned)))
+
+typedef struct {
+	unsigned		index;
+	unsigned		magic;
+	unsigned		refgen[TTIMER_SLAB_ENTS];
+	ttimer_ref_t		ents[];
+} ttimer_slab_t;
+
+#define	TTIMER_SLAB_OF(ent)	\
+    ((ttimer_slab_t *)((uintptr_t)(ent) & ~(uintptr_t)(TTIMER_SLAB_SIZE - 1)))
+
+/*
+ * The handle of the entry allocated from the slabs: the generation of
+ * the entry, which is bumped when it is released, in the upper 32 bits,
+ * then the index of the slab and the index of the entry in the slab.
+ * Zero is never a valid handle.
+ */
+#define	TTIMER_HANDLE(g, s, i)	\
+    (((uint64_t)(g) << 32) | ((uint64_t)(s) << 16) | (i))
+#define	TTIMER_HANDLE_GEN(h)	((unsigned)((h) >> 32))
+#define	TTIMER_HANDLE_SLAB(h)	((unsigned)((h) >> 16) & 0xffff)
+#define	TTIMER_HANDLE_IDX(h)	((unsigned)(h) & 0xffff)
+
+/*
+ * The flag of the wheel slot: the entry has to be skipped when its
+ * bucket is processed next time, i.e. it is due in the following lap.
+ */
+#define	TWHEEL_LAP		(1U << 30)
+
+struct ttimer {
+	unsigned		levels;
+	unsigned		bits;
+	unsigned		lvlbits;
+	unsigned		flags;
+	uint64_t		clock;
+	time_t			lastrun;
+	time_t			epoch;
+
+	/*
+	 * Expired entries pending the handler invocation.  There may
+	 * be any if the ticks were run with a budget.
+	 */
+	ttimer_list_t		expired;
+
+	/*
+	 * Overflow heap: the entries beyond the range of the final level,
+	 * ordered by the expiry time (the clock value, stored in place of
+	 * the remaining time).  They are moved to the wheel only when they
+	 * come within its range, see ttimer_heap_drain().
+	 */
+	ttimer_ref_t **		heap;
+	unsigned		heap_len;
+	unsigned		heap_size;
+
+	/*
+	 * Hybrid mode: whether all entries are in the heap and the number
+	 * of the active (scheduled) entries, see TTIMER_HYBRID_HIGH.
+	 */
+	bool			heapmode;
+	unsigned		nactive;
+
+	/*
+	 * The slabs of the entries and the list of the free entries,
+	 * linked using their list entry.
+	 */
+	void **			slabs;
+	unsigned		nslabs;
+	ttimer_ref_t *		freelist;
+
+	/*
+	 * Tickless mode: the wake-up time reported to the caller and
+	 * the optional handler to notify if it becomes earlier.
+	 */
+	bool			wakeup_valid;
+	time_t			wakeup;
+	ttimer_wakeup_t		wakeup_func;
+	void *			wakeup_arg;
+
+	twheel_t		wheel[];
+};
+
+static inline bool
+twheel_isset(const twheel_t *wheel, unsigned n)
+{
+	return (wheel->bitmap[n >> 6] & (UINT64_C(1) << (n & 63))) != 0;
+}
+
+static inline void
+twheel_set(twheel_t *wheel, unsigned n)
+{
+	wheel->bitmap[n >> 6] |= UINT64_C(1) << (n & 63);
+}
+
+static inline void
+twheel_clear(twheel_t *wheel, unsigned n)
+{
+	wheel->bitmap[n >> 6] &= ~(UINT64_C(1) << (n & 63));
+}
+
+/*
+ * twheel_find: return the first non-empty bucket starting from the
+ * given one (inclusive) or WHEEL_BUCKETS if there are none.
+ */
+static unsigned
+twheel_find(const ttimer_t *timer, const twheel_t *wheel, unsigned n)
+{
+	unsigned i = n >> 6;
+	uint64_t word;
+
+	if (n >= WHEEL_BUCKETS(timer)) {
+		return WHEEL_BUCKETS(timer);
+	}
+	word = wheel->bitmap[i] & (UINT64_MAX << (n & 63));
+	while (word == 0) {
+		if (++i == WHEEL_WORDS(timer)) {
+			return WHEEL_BUCKETS(timer);
+		}
+		word = wheel->bitmap[i];
+	}
+	return (i << 6) | (unsigned)__builtin_ctzll(word);
+}
+
+/*
+ * twheel_count: account the entries added to or removed from the bucket;
+ * the counts are maintained only if cascading incrementally.
+ */
+static inline void
+twheel_count(const ttimer_t *timer, twheel_t *wheel, unsigned n, int delta)
+{
+	if (timer->flags & TTIMER_INCREMENTAL) {
+		wheel->count[n] += delta;
+	}
+}
+
+/*
+ * twheel_unit: return the unit of the level with the given shift, where
+ * the given expiry time belongs.  In the approximate mode, it is rounded
+ * up, so that the entries never expire early.
+ */
+static inline uint64_t
+twheel_unit(const ttimer_t *timer, uint64_t expire, unsigned shift)
+{
+	const uint64_t mask = (UINT64_C(1) << shift) - 1;
+
+	return (expire + ((timer->flags & TTIMER_APPROX) ? mask : 0)) >> shift;
+}
+
+/*
+ * ttimer_splice: insert the chain of linked entries, from "first" to
+ * "last" (inclusive), at the head of the list in one operation.
+ */
+static inline void
+ttimer_splice(ttimer_list_t *list, ttimer_ref_t *first, ttimer_ref_t *last)
+{
+	if ((last->entry.le_next = LIST_FIRST(list)) != NULL) {
+		LIST_FIRST(list)->entry.le_prev = &last->entry.le_next;
+	}
+	LIST_FIRST(list) = first;
+	first->entry.le_prev = &LIST_FIRST(list);
+}
+
+/*
+ * ttimer_heap_set: put the entry at the given position of the heap.
+ */
+static inline void
+ttimer_heap_set(ttimer_t *timer, unsigned i, ttimer_ref_t *ent)
+{
+	timer->heap[i] = ent;
+	ent->slot = TTIMER_SLOT_HEAP | i;
+}
+
+/*
+ * ttimer_heap_sift: restore the heap property for the entry at the
+ * given position, moving it either up or down.
+ */
+static void
+ttimer_heap_sift(ttimer_t *timer, unsigned i)
+{
+	ttimer_ref_t **heap = timer->heap, *ent = heap[i];
+	const unsigned len = timer->heap_len;
+
+	while (i > 0 && heap[(i - 1) / 2]->remaining > ent->remaining) {
+		ttimer_heap_set(timer, i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		unsigned c = (2 * i) + 1;
+
+		if (c >= len) {
+			break;
+		}
+		if (c + 1 < len &&
+		    heap[c + 1]->remaining < heap[c]->remaining) {
+			c++;
+		}
+		if (heap[c]->remaining >= ent->remaining) {
+			break;
+		}
+		ttimer_heap_set(timer, i, heap[c]);
+		i = c;
+	}
+	ttimer_heap_set(timer, i, ent);
+}
+
+/*
+ * ttimer_heap_insert: insert the entry with the given expiry time into
+ * the overflow heap.  Returns false if the heap could not be grown.
+ */
+static bool
+ttimer_heap_insert(ttimer_t *timer, ttimer_ref_t *ent, uint64_t expire)
+{
+	if (timer->heap_len == timer->heap_size) {
+		const unsigned size = timer->heap_size ?
+		    timer->heap_size * 2 : TTIMER_HEAP_MINSIZE;
+		ttimer_ref_t **heap;
+
+		heap = realloc(timer->heap, size * sizeof(ttimer_ref_t *));
+		if (heap == NULL) {
+			return false;
+		}
+		timer->heap = heap;
+		timer->heap_size = size;
+	}
+	ent->remaining = (time_t)expire;
+	timer->heap[timer->heap_len] = ent;
+	ttimer_heap_sift(timer, timer->heap_len++);
+	return true;
+}
+
+/*
+ * ttimer_heap_remove: remove the entry from the overflow heap.
+ */
+static void
+ttimer_heap_remove(ttimer_t *timer, ttimer_ref_t *ent)
+{
+	const unsigned i = TTIMER_HEAP_IDX(ent->slot);
+
+	ASSERT(i < timer->heap_len && timer->heap[i] == ent);
+	if (i != --timer->heap_len) {
+		timer->heap[i] = timer->heap[timer->heap_len];
+		ttimer_heap_sift(timer, i);
+	}
+}
+
+/*
+ * ttimer_heap_due: return the clock value when the entry of the heap,
+ * with the given expiry time, comes within the range of the final level.
+ * In the hybrid heap mode, it is the expiry time itself.
+ */
+static inline uint64_t
+ttimer_heap_due(const ttimer_t *timer, uint64_t expire)
+{
+	const unsigned shift = TWHEEL_SHIFT(timer, timer->levels - 1);
+
+	if (timer->heapmode) {
+		return expire;
+	}
+	return (twheel_unit(timer, expire, shift) -
+	    (WHEEL_BUCKETS(timer) - 1)) << shift;
+}
+
+/*
+ * ttimer_ent_expiry: return the expiry time (the clock value) of the
+ * scheduled entry, wherever it is placed.
+ *
+ * => The wheel bucket is reached once the hand of its level moves by
+ *    the distance to it (a full circle if it is the current one); the
+ *    remaining time is relative to that point.
+ */
+static uint64_t
+ttimer_ent_expiry(const ttimer_t *timer, const ttimer_ref_t *ent)
+{
+	const uint64_t clock = timer->clock;
+	unsigned slot = ent->slot, level, shift, h, k;
+	uint64_t expire;
+
+	ASSERT(ent->scheduled);
+	if (slot == TTIMER_SLOT_EXPIRED) {
+		return clock;
+	}
+	if (slot & TTIMER_SLOT_HEAP) {
+		return (uint64_t)ent->remaining;
+	}
+	slot &= ~TWHEEL_LAP;
+	level = DIV_BY_BUCKETS(timer, slot);
+	shift = TWHEEL_SHIFT(timer, level);
+	h = TWHEEL_HAND(timer, clock, level);
+	k = MOD_BY_BUCKETS(timer, slot - h - 1) + 1;
+
+	if (timer->flags & TTIMER_HASHED) {
+		/* The remaining time is the number of the full rounds. */
+		return clock + k +
+		    ((uint64_t)ent->remaining << timer->bits);
+	}
+	expire = (((clock >> shift) + k) << shift) + ent->remaining;
+	if (ent->slot & TWHEEL_LAP) {
+		expire += (uint64_t)WHEEL_BUCKETS(timer) << shift;
+	}
+	return expire;
+}
+
+ttimer_t *
+ttimer_create(time_t maxtimeout, time_t now)
+{
+	return ttimer_create_flags(maxtimeout, now, 0);
+}
+
+ttimer_t *
+ttimer_create_flags(time_t maxtimeout, time_t now, unsigned flags)
+{
+	const bool approx = (flags & TTIMER_APPROX) != 0;
+	const unsigned lvlbits = approx ? WHEEL_APPROX_BITS : WHEEL_BITS;
+	const unsigned maxlevels = approx ?
+	    WHEEL_APPROX_LEVELS : WHEEL_MAX_LEVELS;
+	unsigned levels = 0;
+
+	while (maxtimeout > 0) {
+		maxtimeout >>= levels ? lvlbits : WHEEL_BITS;
+		levels++;
+	}
+	levels = levels ? MIN(levels, maxlevels) : maxlevels;
+	if (flags & TTIMER_HASHED) {
+		levels = 1;
+	}
+	return ttimer_create_ex(WHEEL_BITS, levels, now, flags);
+}
+
+/*
+ * ttimer_create_ex: construct the timer with 2^bits buckets per wheel
+ * and the given number of levels.  Returns NULL if the geometry is not
+ * supported or on the allocation failure.
+ *
+ * => The levels, the bitmaps and the buckets are allocated in one go:
+ *    the bitmaps of all levels follow the wheel structures, then the
+ *    buckets and then the counts (only if cascading incrementally).
+ */
+ttimer_t *
+ttimer_create_ex(unsigned bits, unsigned levels, time_t now, unsigned flags)
+{
+	const bool approx = (flags & (TTIMER_APPROX | TTIMER_HASHED)) ==
+	    TTIMER_APPROX;
+	const unsigned lvlbits = approx ? WHEEL_APPROX_BITS : bits;
+	const unsigned nbuckets = 1U << bits, nwords = (nbuckets + 63) / 64;
+	size_t len, wlen, blen, clen;
+	ttimer_t *timer;
+	uint8_t *p;
+
+	if (bits < WHEEL_MIN_BITS || bits > WHEEL_MAX_BITS ||
+	    levels == 0 || levels > WHEEL_LIMIT_LEVELS ||
+	    (levels - 1) * lvlbits + bits > 62) {
+		return NULL;
+	}
+	if (flags & TTIMER_HASHED) {
+		/* A single wheel with the rounds; nothing else applies. */
+		if (levels != 1) {
+			return NULL;
+		}
+		flags &= ~(TTIMER_APPROX | TTIMER_INCREMENTAL | TTIMER_HYBRID);
+	}
+	if (flags & TTIMER_HYBRID) {
+		/* The entries are moved as a whole; nothing is lapped. */
+		flags &= ~TTIMER_INCREMENTAL;
+	}
+	if (approx) {
+		/* Nothing to cascade. */
+		flags &= ~TTIMER_INCREMENTAL;
+	}
+	len = offsetof(ttimer_t, wheel[levels]);
+	wlen = nwords * sizeof(uint64_t);
+	blen = nbuckets * sizeof(ttimer_list_t);
+	clen = (flags & TTIMER_INCREMENTAL) ? nbuckets * sizeof(unsigned) : 0;
+
+	if ((timer = calloc(1, len + levels * (wlen + blen + clen))) == NULL) {
+		return NULL;
+	}
+	p = (uint8_t *)timer + len;
+	for (unsigned i = 0; i < levels; i++) {
+		twheel_t *wheel = &timer->wheel[i];
+
+		wheel->bitmap = (void *)(p + (i * wlen));
+		wheel->bucket = (void *)(p + (levels * wlen) + (i * blen));
+		wheel->count = clen ? (void *)(p +
+		    (levels * (wlen + blen)) + (i * clen)) : NULL;
+	}
+	timer->levels = levels;
+	timer->bits = bits;
+	timer->lvlbits = lvlbits;
+	timer->flags = flags;
+	timer->heapmode = (flags & TTIMER_HYBRID) != 0;
+	timer->lastrun = now;
+	timer->epoch = now;
+	return timer;
+}
+
+void
+ttimer_destroy(ttimer_t *timer)
+{
+	for (unsigned i = 0; i < timer->nslabs; i++) {
+		free(timer->slabs[i]);
+	}
+	free(timer->slabs);
+	free(timer->heap);
+	free(timer);
+}
+
+/*
+ * ttimer_slab_grow: allocate a new slab and put its entries on the
+ * free list.  Returns false on failure.
+ */
+static bool
+ttimer_slab_grow(ttimer_t *timer)
+{
+	ttimer_slab_t *slab;
+	void **slabs, *p;
+
+	if (timer->nslabs == TTIMER_SLAB_MAX) {
+		return false;
+	}
+	slabs = realloc(timer->slabs, (timer->nslabs + 1) * sizeof(void *));
+	if (slabs == NULL) {
+		return false;
+	}
+	timer->slabs = slabs;
+
+	if (posix_memalign(&p, TTIMER_SLAB_SIZE, TTIMER_SLAB_SIZE) != 0) {
+		return false;
+	}
+	slab = p;
+	ASSERT(offsetof(ttimer_slab_t, ents) +
+	    TTIMER_SLAB_ENTS * sizeof(ttimer_ref_t) <= TTIMER_SLAB_SIZE);
+	slab->index = timer->nslabs;
+	slab->magic = TTIMER_SLAB_MAGIC;
+	timer->slabs[timer->nslabs++] = slab;
+
+	/* Link in the reverse, so that they are allocated in order. */
+	for (unsigned i = TTIMER_SLAB_ENTS; i-- > 0;) {
+		slab->ents[i].entry.le_next = timer->freelist;
+		slab->refgen[i] = 1;
+		timer->freelist = &slab->ents[i];
+	}
+	return true;
+}
+
+/*
+ * ttimer_ref_alloc: allocate a zeroed entry from the slabs of the timer.
+ * Returns NULL on failure.
+ */
+ttimer_ref_t *
+ttimer_ref_alloc(ttimer_t *timer)
+{
+	ttimer_ref_t *ent;
+
+	if (__predict_false(timer->freelist == NULL) &&
+	    !ttimer_slab_grow(timer)) {
+		return NULL;
+	}
+	ent = timer->freelist;
+	timer->freelist = ent->entry.le_next;
+
+	/* Note: the generation, in the slab, stays. */
+	memset(ent, 0, sizeof(ttimer_ref_t));
+	return ent;
+}
+
+/*
+ * ttimer_ref_free: stop the timer of the entry, if active, and return
+ * the entry to the free list.  Its handle, if any, becomes stale.
+ */
+void
+ttimer_ref_free(ttimer_t *timer, ttimer_ref_t *ent)
+{
+	ttimer_slab_t *slab = TTIMER_SLAB_OF(ent);
+	const unsigned i = ent - slab->ents;
+
+	ttimer_stop(timer, ent);
+	if (__predict_false(++slab->refgen[i] == 0)) {
+		slab->refgen[i] = 1;
+	}
+	ent->entry.le_next = timer->freelist;
+	timer->freelist = ent;
+}
+
+void
+ttimer_setfunc(ttimer_ref_t *ent, ttimer_func_t handler, void *arg)
+{
+	ent->scheduled = false;
+	ent->func = handler;
+	ent->arg = arg;
+	ent->group = NULL;
+}
+
+/*
+ * ttimer_setgroup: set the group of the entry (or NULL for none).  It
+ * must be called after ttimer_setfunc(), before starting the timer.
+ */
+void
+ttimer_setgroup(ttimer_ref_t *ent, ttimer_group_t *group)
+{
+	/* Note: the entry is accounted in its group while scheduled. */
+	ASSERT(!ent->scheduled);
+	ent->group = group;
+}
+
+void
+ttimer_group_init(ttimer_group_t *group)
+{
+	group->gen = 0;
+	group->nrefs = 0;
+}
+
+/*
+ * ttimer_group_cancel: cancel the timers of all entries in the group.
+ * The entries are not touched: the generation of the group is bumped
+ * and the entries of the older generation are no longer active.  They
+ * are discarded, without calling their handlers, when the ticks reach
+ * their buckets (i.e. on the cascade, at the latest on the expiry) or
+ * when they are started or stopped again.
+ *
+ * => The entries and the group must stay valid until they are all
+ *    discarded, see ttimer_group_pending().
+ */
+void
+ttimer_group_cancel(ttimer_group_t *group)
+{
+	/* Note: the generation of the entry is packed into 31 bits. */
+	group->gen = (group->gen + 1) & (UINT_MAX >> 1);
+}
+
+/*
+ * ttimer_group_pending: return the number of the entries of the group
+ * which are still in the timer, including the cancelled ones.
+ */
+unsigned
+ttimer_group_pending(const ttimer_group_t *group)
+{
+	return group->nrefs;
+}
+
+/*
+ * ttimer_active: return true if the timer of the entry is active, i.e.
+ * it is scheduled and its group was not cancelled since it was started.
+ */
+static inline bool
+ttimer_active(const ttimer_ref_t *ent)
+{
+	return ent->scheduled &&
+	    (ent->group == NULL || ent->gen == ent->group->gen);
+}
+
+/*
+ * ttimer_activate: account the entry which is being started.  If the
+ * entry was cancelled with its group, but it is not yet discarded, then
+ * it is unlinked first.
+ */
+static inline void
+ttimer_activate(ttimer_t *timer, ttimer_ref_t *ent, uint64_t expire)
+{
+	if (__predict_false(ent->scheduled)) {
+		ASSERT(!ttimer_active(ent));
+		ttimer_stop(timer, ent);
+	}
+	ent->expire = expire;
+	ent->period = 0;
+	timer->nactive++;
+	if (ent->group) {
+		ent->gen = ent->group->gen;
+		ent->group->nrefs++;
+	}
+}
+
+/*
+ * ttimer_deactivate: account the entry which is no longer scheduled.
+ */
+static inline void
+ttimer_deactivate(ttimer_t *timer, ttimer_ref_t *ent)
+{
+	timer->nactive--;
+	if (ent->group) {
+		ent->group->nrefs--;
+	}
+}
+
+/*
+ * ttimer_drain_ent: unschedule the entry, which is being drained, and
+ * pass it to the cleanup function, unless it was cancelled.
+ */
+static void
+ttimer_drain_ent(ttimer_t *timer, ttimer_ref_t *ent,
+    ttimer_func_t cleanup, void *arg)
+{
+	const bool active = ttimer_active(ent);
+
+	ASSERT(ent->scheduled);
+	ent->scheduled = false;
+	ttimer_deactivate(timer, ent);
+	if (active) {
+		cleanup(ent, arg);
+	}
+}
+
+/*
+ * ttimer_drain_list: pass the entries of the list to the cleanup
+ * function, see ttimer_destroy_drain().
+ */
+static void
+ttimer_drain_list(ttimer_t *timer, ttimer_list_t *list,
+    ttimer_func_t cleanup, void *arg)
+{
+	ttimer_ref_t *ent, *next;
+
+	for (ent = LIST_FIRST(list); ent != NULL; ent = next) {
+		next = LIST_NEXT(ent, entry);
+		ttimer_drain_ent(timer, ent, cleanup, arg);
+	}
+	LIST_INIT(list);
+}
+
+/*
+ * ttimer_destroy_drain: destroy the timer, passing each entry which is
+ * still scheduled to the cleanup function, called as cleanup(entry, arg).
+ * The entries are no longer scheduled when it is called, therefore it may
+ * release them; it must not use the timer.
+ *
+ * => The entries are visited in one pass, in the memory order: the
+ *    pending expired entries, the overflow heap and then the buckets
+ *    of each level.  The entries of the cancelled groups are skipped.
+ */
+void
+ttimer_destroy_drain(ttimer_t *timer, ttimer_func_t cleanup, void *arg)
+{
+	ttimer_drain_list(timer, &timer->expired, cleanup, arg);
+	for (unsigned i = 0; i < timer->heap_len; i++) {
+		ttimer_drain_ent(timer, timer->heap[i], cleanup, arg);
+	}
+	timer->heap_len = 0;
+
+	for (unsigned level = 0; level < timer->levels; level++) {
+		twheel_t *wheel = &timer->wheel[level];
+		unsigned n = 0;
+
+		while ((n = twheel_find(timer, wheel, n)) !=
+		    WHEEL_BUCKETS(timer)) {
+			ttimer_drain_list(timer, &wheel->bucket[n],
+			    cleanup, arg);
+			twheel_clear(wheel, n);
+		}
+		ttimer_drain_list(timer, &wheel->lapped, cleanup, arg);
+	}
+	ttimer_destroy(timer);
+}
+
+/*
+ * ttimer_notify: tickless mode: the new entry may be reached before
+ * the wake-up time which was reported to the caller.  If so, bring it
+ * earlier and notify the caller.
+ */
+static inline void
+ttimer_notify(ttimer_t *timer, time_t due)
+{
+	if (timer->wakeup_valid && (timer->wakeup == -1 ||
+	    due < timer->wakeup)) {
+		timer->wakeup = due;
+		if (timer->wakeup_func) {
+			timer->wakeup_func(timer, timer->wakeup,
+			    timer->wakeup_arg);
+		}
+	}
+}
+
+/*
+ * ttimer_start_hashed: start the timer in the hashed wheel (the scheme 6
+ * by Varghese and Lauck).  The bucket is the expiry time modulo the size
+ * of the wheel and the remaining time is the number of the full rounds
+ * the hand has to make before the entry expires.
+ */
+static void
+ttimer_start_hashed(ttimer_t *timer, ttimer_ref_t *ent, time_t timeout)
+{
+	const unsigned n = MOD_BY_BUCKETS(timer, timer->clock + timeout);
+	twheel_t *wheel = &timer->wheel[0];
+
+	ent->remaining = (timeout - 1) >> timer->bits;
+	LIST_INSERT_HEAD(&wheel->bucket[n], ent, entry);
+	twheel_set(wheel, n);
+	ent->slot = n;
+	ent->scheduled = true;
+
+	/* The bucket is reached within a round. */
+	ttimer_notify(timer, timer->lastrun +
+	    (time_t)MOD_BY_BUCKETS(timer, (uint64_t)timeout - 1) + 1);
+}
+
+/*
+ * twheel_place: find the level and the bucket for the entry with the
+ * given expiry time and set its remaining time.  Returns the slot and
+ * the clock value when the bucket is reached (in "due").  If the time
+ * is beyond the range of the final level, then returns TTIMER_SLOT_HEAP
+ * or, if the overflow heap cannot be used, the last bucket of the final
+ * level before the hand.
+ */
+static inline unsigned
+twheel_place(const ttimer_t *timer, ttimer_ref_t *ent, uint64_t expire,
+    bool overflow, uint64_t *due)
+{
+	const uint64_t clock = timer->clock;
+	unsigned level = 0, shift = 0;
+	uint64_t n;
+
+	/*
+	 * The algorithm to find the target bucket and the remaining
+	 * time is conceptually the same with the digital clock time.
+	 *
+	 * As an example, let the current time be 22:58:57 i.e. 2 min
+	 * and 3 sec before midnight.  Now consider adding 192 seconds
+	 * to it.  It would result in 23:02:09.  The logic being:
+	 *
+	 * L0 (seconds): 23:02:09 is 192 seconds away, i.e. the hand
+	 * would have to go around more than once; not in this level.
+	 * L1 (minutes): 23:02 is 4 minutes away from 22:58, which is
+	 * less than a full circle of 60.
+	 *
+	 * Hence, the level to insert is L1 and the bucket to insert is 2
+	 * (the minute of the expiry time).  The remaining time is the
+	 * part of the expiry time below the level, i.e. 9 seconds.  In
+	 * other words, once the clock will reach 23:02:00, there will be
+	 * 9 seconds remaining until 23:02:09.
+	 *
+	 * Our timing wheel has 256 units, therefore the time before
+	 * "midnight" is 255:255:255 and we divide and modulus by 256.
+	 *
+	 * In the approximate mode, the expiry time is rounded up to the
+	 * unit of the level instead, therefore there is no remaining time
+	 * (unless the final level is reached).
+	 */
+	for (;;) {
+		n = twheel_unit(timer, expire, shift);
+		if (__predict_true(n - (clock >> shift) <
+		    WHEEL_BUCKETS(timer))) {
+			break;
+		}
+		if (__predict_false(level + 1 == timer->levels)) {
+			if (overflow) {
+				return TTIMER_SLOT_HEAP;
+			}
+			/* Re-calculated when the bucket is reached. */
+			n = (clock >> shift) + WHEEL_BUCKETS(timer) - 1;
+			break;
+		}
+		shift += timer->lvlbits;
+		level++;
+	}
+	ent->remaining = (expire > (n << shift)) ? expire - (n << shift) : 0;
+	*due = n << shift;
+	return (level << timer->bits) + MOD_BY_BUCKETS(timer, n);
+}
+
+/*
+ * ttimer_insert: schedule the entry in the wheel (or the overflow heap,
+ * if it is beyond the range of the wheel).
+ */
+static void
+ttimer_insert(ttimer_t *timer, ttimer_ref_t *ent, time_t timeout)
+{
+	const uint64_t clock = timer->clock;
+	const uint64_t expire = clock + (uint64_t)timeout;
+	twheel_t *wheel;
+	unsigned slot, n;
+	uint64_t due;
+
+	ASSERT(timeout > 0);
+	ASSERT(!ent->scheduled);
+	ASSERT(ent->func != NULL);
+
+	if (timer->flags & TTIMER_HASHED) {
+		ttimer_start_hashed(timer, ent, timeout);
+		return;
+	}
+
+	slot = twheel_place(timer, ent, expire, true, &due);
+	if (__predict_false(slot == TTIMER_SLOT_HEAP)) {
+		/*
+		 * If we reach the final level, then put the entry into
+		 * the overflow heap.  If that fails, just take the last
+		 * bucket before the hand and let the time be re-calculated
+		 * when it is reached.
+		 */
+		if (ttimer_heap_insert(timer, ent, expire)) {
+			ent->scheduled = true;
+			due = ttimer_heap_due(timer, expire);
+			ttimer_notify(timer,
+			    timer->lastrun + (time_t)(due - clock));
+			return;
+		}
+		slot = twheel_place(timer, ent, expire, false, &due);
+	}
+
+	/*
+	 * Insert the entry into the wheel bucket and mark as scheduled.
+	 * Note the slot, so that the bucket could be found on removal.
+	 */
+	wheel = &timer->wheel[DIV_BY_BUCKETS(timer, slot)];
+	n = MOD_BY_BUCKETS(timer, slot);
+	LIST_INSERT_HEAD(&wheel->bucket[n], ent, entry);
+	twheel_set(wheel, n);
+	twheel_count(timer, wheel, n, 1);
+	ent->slot = slot;
+	ent->scheduled = true;
+	ttimer_notify(timer, timer->lastrun + (time_t)(due - clock));
+}
+
+/*
+ * ttimer_hybrid_wheel: hybrid mode: move all entries from the heap to
+ * the wheel.  The entries beyond the range of the wheel go back to the
+ * (new) overflow heap.
+ */
+static void
+ttimer_hybrid_wheel(ttimer_t *timer)
+{
+	ttimer_ref_t **heap = timer->heap;
+	const unsigned len = timer->heap_len;
+
+	timer->heapmode = false;
+	timer->heap = NULL;
+	timer->heap_len = timer->heap_size = 0;
+
+	for (unsigned i = 0; i < len; i++) {
+		ttimer_ref_t *ent = heap[i];
+		const uint64_t expire = (uint64_t)ent->remaining;
+
+		/* Note: the due entries were expired on the last tick. */
+		ASSERT(expire > timer->clock);
+		ent->scheduled = false;
+		ttimer_insert(timer, ent, (time_t)(expire - timer->clock));
+	}
+	free(heap);
+}
+
+/*
+ * ttimer_hybrid_heap: hybrid mode: move all entries from the wheel to
+ * the heap.  The heap is grown upfront, so that the move cannot fail
+ * half-way; if it cannot be grown, then the entries stay in the wheel.
+ */
+static void
+ttimer_hybrid_heap(ttimer_t *timer)
+{
+	if (timer->heap_size < timer->nactive) {
+		ttimer_ref_t **heap;
+
+		heap = realloc(timer->heap,
+		    timer->nactive * sizeof(ttimer_ref_t *));
+		if (heap == NULL) {
+			return;
+		}
+		timer->heap = heap;
+		timer->heap_size = timer->nactive;
+	}
+	for (unsigned level = 0; level < timer->levels; level++) {
+		twheel_t *wheel = &timer->wheel[level];
+		unsigned n = 0;
+
+		while ((n = twheel_find(timer, wheel, n)) !=
+		    WHEEL_BUCKETS(timer)) {
+			ttimer_ref_t *ent;
+
+			while ((ent = LIST_FIRST(&wheel->bucket[n])) != NULL) {
+				const uint64_t expire =
+				    ttimer_ent_expiry(timer, ent);
+
+				LIST_REMOVE(ent, entry);
+				ttimer_heap_insert(timer, ent, expire);
+			}
+			twheel_clear(wheel, n);
+		}
+	}
+	timer->heapmode = true;
+}
+
+/*
+ * ttimer_hybrid_check: hybrid mode: move the entries back to the heap
+ * if the number of the timers has dropped below the low mark.
+ */
+static inline void
+ttimer_hybrid_check(ttimer_t *timer)
+{
+	if ((timer->flags & TTIMER_HYBRID) && !timer->heapmode &&
+	    timer->nactive < TTIMER_HYBRID_LOW) {
+		ttimer_hybrid_heap(timer);
+	}
+}
+
+/*
+ * ttimer_schedule: schedule the entry, either in the heap (in the hybrid
+ * heap mode) or in the wheel.
+ */
+static void
+ttimer_schedule(ttimer_t *timer, ttimer_ref_t *ent, time_t timeout)
+{
+	if (timer->heapmode) {
+		/*
+		 * Hybrid mode: a few timers are kept in the heap, until
+		 * there are too many of them (or the heap cannot grow).
+		 */
+		if (timer->nactive <= TTIMER_HYBRID_HIGH &&
+		    ttimer_heap_insert(timer, ent,
+		    timer->clock + (uint64_t)timeout)) {
+			ent->scheduled = true;
+			ttimer_notify(timer, timer->lastrun + timeout);
+			return;
+		}
+		ttimer_hybrid_wheel(timer);
+	}
+	ttimer_insert(timer, ent, timeout);
+}
+
+void
+ttimer_start(ttimer_t *timer, ttimer_ref_t *ent, time_t timeout)
+{
+	ASSERT(timeout > 0);
+	ASSERT(ent->func != NULL);
+
+	ttimer_activate(timer, ent, timer->clock + (uint64_t)timeout);
+	ttimer_schedule(timer, ent, timeout);
+}
+
+/*
+ * ttimer_start_at: start the timer to expire at the given absolute time,
+ * in the same units as "now" given to ttimer_run_ticks().  If the time
+ * has already passed, then the timer expires on the next tick.
+ *
+ * => The current time is derived from the clock, i.e. the time given on
+ *    the creation plus the ticks run, which includes ttimer_tick().
+ */
+void
+ttimer_start_at(ttimer_t *timer, ttimer_ref_t *ent, time_t deadline)
+{
+	const time_t timeout = deadline - (timer->epoch + (time_t)timer->clock);
+
+	ttimer_start(timer, ent, timeout > 0 ? timeout : 1);
+}
+
+/*
+ * ttimer_start_periodic: start the timer which expires every "period"
+ * ticks, until it is stopped.  The entry is re-scheduled on every expiry
+ * before its handler is called, see ttimer_fire().
+ */
+void
+ttimer_start_periodic(ttimer_t *timer, ttimer_ref_t *ent, time_t period)
+{
+	ttimer_start(timer, ent, period);
+	ent->period = period;
+}
+
+/*
+ * twheel_find_range: find the first non-empty bucket of the level for
+ * the units from "ua" to "ub" (inclusive), which must be less than a
+ * full lap; note the wrap around.  Returns the unit or zero if none
+ * (the units of the bucket before the hand are never zero).
+ */
+static uint64_t
+twheel_find_range(const ttimer_t *timer, const twheel_t *wheel,
+    uint64_t ua, uint64_t ub)
+{
+	const unsigned a = MOD_BY_BUCKETS(timer, ua);
+	const uint64_t len = ub - ua + 1;
+	unsigned n;
+
+	if (ua > ub) {
+		return 0;
+	}
+	n = twheel_find(timer, wheel, a);
+	if (n == WHEEL_BUCKETS(timer) && a + len > n) {
+		n += twheel_find(timer, wheel, 0);
+	}
+	return (n - a < len) ? ua + (n - a) : 0;
+}
+
+/*
+ * ttimer_start_range: start the timer to expire at any point within the
+ * [min, max] range of ticks.  The entry joins the first bucket, of the
+ * lowest level covering the range, which already has entries: it expires
+ * at the same tick as the first entry there, if within the range, or the
+ * nearest one.  If there are none, then it expires at the most aligned
+ * tick within the range, e.g. a multiple of 1024 ticks if possible.
+ * Hence, the expirations of the timers with the overlapping ranges are
+ * coalesced into fewer ticks.
+ */
+void
+ttimer_start_range(ttimer_t *timer, ttimer_ref_t *ent, time_t min, time_t max)
+{
+	const uint64_t clock = timer->clock;
+	const uint64_t lo = clock + (uint64_t)min;
+	const uint64_t hi = clock + (uint64_t)max;
+
+	ASSERT(min > 0 && min <= max);
+
+	for (unsigned level = 0; !timer->heapmode &&
+	    (timer->flags & TTIMER_HASHED) == 0 && level < timer->levels;
+	    level++) {
+		const twheel_t *wheel = &timer->wheel[level];
+		const unsigned shift = TWHEEL_SHIFT(timer, level);
+		const uint64_t hand = clock >> shift;
+		const ttimer_ref_t *first;
+		uint64_t u, expire;
+
+		/*
+		 * The units of the level within the range, up to the one
+		 * before the hand.  Note: the hand unit itself is already
+		 * processed (or it is the current tick).
+		 */
+		u = twheel_find_range(timer, wheel, MAX(lo >> shift, hand + 1),
+		    MIN(hi >> shift, hand + WHEEL_BUCKETS(timer) - 1));
+		if (u == 0) {
+			continue;
+		}
+		first = LIST_FIRST(&wheel->bucket[MOD_BY_BUCKETS(timer, u)]);
+		expire = (u << shift) + (uint64_t)first->remaining;
+		expire = MIN(MAX(expire, lo), hi);
+		ttimer_start(timer, ent, (time_t)(expire - clock));
+		return;
+	}
+	if (lo != hi) {
+		/*
+		 * The most aligned tick: the common prefix of the range
+		 * bounds, then the first bit where they differ set.
+		 */
+		const unsigned bit = 63 - __builtin_clzll(lo ^ hi);
+
+		ttimer_start(timer, ent,
+		    (time_t)((hi & ~((UINT64_C(1) << bit) - 1)) - clock));
+		return;
+	}
+	ttimer_start(timer, ent, min);
+}
+
+/*
+ * ttimer_stop: stop the timer of the entry.  Returns true if it was
+ * active.  Note: the entry of a cancelled group is unlinked too.
+ */
+bool
+ttimer_stop(ttimer_t *timer, ttimer_ref_t *ent)
+{
+	const bool active = ttimer_active(ent);
+	bool stop = ent->scheduled;
+
+	if (stop && ent->slot == TTIMER_SLOT_EXPIRED) {
+		/* Expired, but the handler was not yet called. */
+		LIST_REMOVE(ent, entry);
+		ent->scheduled = false;
+
+	} else if (stop && (ent->slot & TTIMER_SLOT_HEAP)) {
+		ttimer_heap_remove(timer, ent);
+		ent->scheduled = false;
+
+	} else if (stop) {
+		const unsigned slot = ent->slot & ~TWHEEL_LAP;
+		twheel_t *wheel = &timer->wheel[DIV_BY_BUCKETS(timer, slot)];
+		const unsigned n = MOD_BY_BUCKETS(timer, slot);
+
+		/* Note: the entry might be set aside on the lapped list. */
+		LIST_REMOVE(ent, entry);
+		if (LIST_EMPTY(&wheel->bucket[n])) {
+			twheel_clear(wheel, n);
+		}
+		twheel_count(timer, wheel, n, -1);
+		ent->scheduled = false;
+	}
+	if (stop) {
+		ttimer_deactivate(timer, ent);
+	}
+	return active;
+}
+
+/*
+ * ttimer_restart_inplace: try to re-start the active timer without moving
+ * the entry, i.e. if it would be placed into the same bucket again (or it
+ * stays in the heap).  Returns true on success.
+ */
+static bool
+ttimer_restart_inplace(ttimer_t *timer, ttimer_ref_t *ent, time_t timeout)
+{
+	const uint64_t clock = timer->clock;
+	const uint64_t expire = clock + (uint64_t)timeout;
+	unsigned slot = ent->slot, level, shift;
+	uint64_t n;
+
+	if (slot == TTIMER_SLOT_EXPIRED) {
+		return false;
+	}
+	if (slot & TTIMER_SLOT_HEAP) {
+		const unsigned topshift =
+		    TWHEEL_SHIFT(timer, timer->levels - 1);
+
+		/*
+		 * Staying in the heap, i.e. still beyond the range of the
+		 * final level (always, in the hybrid heap mode): just
+		 * restore the heap order.
+		 */
+		if (!timer->heapmode && twheel_unit(timer, expire, topshift) -
+		    (clock >> topshift) < WHEEL_BUCKETS(timer)) {
+			return false;
+		}
+		ent->remaining = (time_t)expire;
+		ttimer_heap_sift(timer, TTIMER_HEAP_IDX(slot));
+		ttimer_notify(timer, timer->lastrun +
+		    (time_t)(ttimer_heap_due(timer, expire) - clock));
+		return true;
+	}
+	if (timer->flags & TTIMER_HASHED) {
+		/* The same bucket: just the number of rounds changes. */
+		if (slot != MOD_BY_BUCKETS(timer, expire)) {
+			return false;
+		}
+		ent->remaining = (timeout - 1) >> timer->bits;
+		return true;
+	}
+	if (slot & TWHEEL_LAP) {
+		return false;
+	}
+
+	/*
+	 * The same bucket, as ttimer_insert() would choose: it must be
+	 * within the range of the level, but not of the level below.
+	 * The bucket is reached at the same time, hence no notification.
+	 */
+	level = DIV_BY_BUCKETS(timer, slot);
+	shift = TWHEEL_SHIFT(timer, level);
+	n = twheel_unit(timer, expire, shift);
+	if (MOD_BY_BUCKETS(timer, n) != MOD_BY_BUCKETS(timer, slot) ||
+	    n - (clock >> shift) >= WHEEL_BUCKETS(timer)) {
+		return false;
+	}
+	if (level) {
+		const unsigned lshift = TWHEEL_SHIFT(timer, level - 1);
+
+		if (twheel_unit(timer, expire, lshift) - (clock >> lshift) <
+		    WHEEL_BUCKETS(timer)) {
+			return false;
+		}
+	}
+	ent->remaining = (expire > (n << shift)) ? expire - (n << shift) : 0;
+	return true;
+}
+
+/*
+ * ttimer_restart: start the timer of the entry with the new timeout,
+ * whether it is active or not.  If the entry would stay in the same
+ * bucket, then only its remaining time is updated.
+ */
+void
+ttimer_restart(ttimer_t *timer, ttimer_ref_t *ent, time_t timeout)
+{
+	ASSERT(timeout > 0);
+
+	if (ttimer_active(ent)) {
+		ent->expire = timer->clock + (uint64_t)timeout;
+		ent->period = 0;
+		if (ttimer_restart_inplace(timer, ent, timeout)) {
+			return;
+		}
+	}
+	ttimer_stop(timer, ent);
+	ttimer_start(timer, ent, timeout);
+}
+
+/*
+ * ttimer_expires_in: return the number of ticks until the timer of the
+ * entry expires, zero if it has expired (but the handler is pending) or
+ * -1 if the timer is not active.
+ *
+ * => The value reflects the extensions (see ttimer_extend).
+ */
+time_t
+ttimer_expires_in(const ttimer_t *timer, const ttimer_ref_t *ent)
+{
+	if (!ttimer_active(ent)) {
+		return -1;
+	}
+	return ent->expire > timer->clock ?
+	    (time_t)(ent->expire - timer->clock) : 0;
+}
+
+/*
+ * ttimer_handle_get: return the handle of the entry, which must have
+ * been allocated using ttimer_ref_alloc() or ttimer_handle_alloc(); the
+ * entries embedded in the caller's structures have no handles.
+ */
+ttimer_handle_t
+ttimer_handle_get(const ttimer_ref_t *ent)
+{
+	const ttimer_slab_t *slab = TTIMER_SLAB_OF(ent);
+	const uintptr_t off = (uintptr_t)ent - (uintptr_t)slab->ents;
+
+	ASSERT(off % sizeof(ttimer_ref_t) == 0);
+	ASSERT(off / sizeof(ttimer_ref_t) < TTIMER_SLAB_ENTS);
+	ASSERT(slab->magic == TTIMER_SLAB_MAGIC);
+	ASSERT(slab->index < TTIMER_SLAB_MAX);
+
+	return TTIMER_HANDLE(slab->refgen[off / sizeof(ttimer_ref_t)],
+	    slab->index, off / sizeof(ttimer_ref_t));
+}
+
+/*
+ * ttimer_handle_ref: return the entry of the handle or NULL if the
+ * handle is stale (i.e. the entry was released) or invalid.
+ */
+ttimer_ref_t *
+ttimer_handle_ref(const ttimer_t *timer, ttimer_handle_t handle)
+{
+	const unsigned s = TTIMER_HANDLE_SLAB(handle);
+	const unsigned i = TTIMER_HANDLE_IDX(handle);
+	ttimer_slab_t *slab;
+
+	if (__predict_false(s >= timer->nslabs || i >= TTIMER_SLAB_ENTS)) {
+		return NULL;
+	}
+	slab = timer->slabs[s];
+	if (slab->refgen[i] != TTIMER_HANDLE_GEN(handle)) {
+		return NULL;
+	}
+	return &slab->ents[i];
+}
+
+/*
+ * ttimer_handle_alloc: allocate the entry, set its handler and return
+ * its handle.  Returns zero on failure.
+ */
+ttimer_handle_t
+ttimer_handle_alloc(ttimer_t *timer, ttimer_func_t handler, void *arg)
+{
+	ttimer_ref_t *ent;
+
+	if ((ent = ttimer_ref_alloc(timer)) == NULL) {
+		return 0;
+	}
+	ttimer_setfunc(ent, handler, arg);
+	return ttimer_handle_get(ent);
+}
+
+/*
+ * ttimer_handle_free: stop the timer of the entry, if active, and
+ * release the entry.  Returns false if the handle is stale.
+ */
+bool
+ttimer_handle_free(ttimer_t *timer, ttimer_handle_t handle)
+{
+	ttimer_ref_t *ent;
+
+	if ((ent = ttimer_handle_ref(timer, handle)) == NULL) {
+		return false;
+	}
+	ttimer_ref_free(timer, ent);
+	return true;
+}
+
+/*
+ * ttimer_handle_start: start the timer of the entry, unless it is
+ * already active.  Returns false if the handle is stale or the timer
+ * is already active.
+ */
+bool
+ttimer_handle_start(ttimer_t *timer, ttimer_handle_t handle, time_t timeout)
+{
+	ttimer_ref_t *ent;
+
+	if ((ent = ttimer_handle_ref(timer, handle)) == NULL ||
+	    ttimer_active(ent)) {
+		return false;
+	}
+	ttimer_start(timer, ent, timeout);
+	return true;
+}
+
+/*
+ * ttimer_handle_stop: stop the timer of the entry.  Returns true if it
+ * was active and false if it was not or if the handle is stale.
+ */
+bool
+ttimer_handle_stop(ttimer_t *timer, ttimer_handle_t handle)
+{
+	ttimer_ref_t *ent;
+
+	if ((ent = ttimer_handle_ref(timer, handle)) == NULL) {
+		return false;
+	}
+	return ttimer_stop(timer, ent);
+}
+
+/*
+ * ttimer_handle_restart: re-start the timer of the entry, see
+ * ttimer_restart().  Returns false if the handle is stale.
+ */
+bool
+ttimer_handle_restart(ttimer_t *timer, ttimer_handle_t handle,
+    time_t timeout)
+{
+	ttimer_ref_t *ent;
+
+	if ((ent = ttimer_handle_ref(timer, handle)) == NULL) {
+		return false;
+	}
+	ttimer_restart(timer, ent, timeout);
+	return true;
+}
+
+/*
+ * twheel_link: insert the chain of the entries, from "first" to "last",
+ * which all have the same slot, into its bucket.
+ */
+static inline void
+twheel_link(ttimer_t *timer, unsigned slot, ttimer_ref_t *first,
+    ttimer_ref_t *last, unsigned nents)
+{
+	twheel_t *wheel = &timer->wheel[DIV_BY_BUCKETS(timer, slot)];
+	const unsigned n = MOD_BY_BUCKETS(timer, slot);
+
+	ttimer_splice(&wheel->bucket[n], first, last);
+	twheel_set(wheel, n);
+	twheel_count(timer, wheel, n, (int)nents);
+}
+
+/*
+ * The entries of a batch placed into the wheel, but not yet linked.
+ */
+typedef struct {
+	ttimer_ref_t *	vec[TTIMER_BATCH_CHUNK];
+	unsigned	n;
+	uint64_t	due;
+} ttimer_batch_t;
+
+static int
+ttimer_slot_cmp(const void *a, const void *b)
+{
+	const ttimer_ref_t *ea = *(ttimer_ref_t * const *)a;
+	const ttimer_ref_t *eb = *(ttimer_ref_t * const *)b;
+
+	return (ea->slot > eb->slot) - (ea->slot < eb->slot);
+}
+
+/*
+ * ttimer_batch_flush: sort the placed entries by their slot and link
+ * each run of the entries with the same slot into its bucket in one go.
+ */
+static void
+ttimer_batch_flush(ttimer_t *timer, ttimer_batch_t *batch)
+{
+	ttimer_ref_t **vec = batch->vec;
+	unsigned i = 0;
+
+	if (batch->n > 1) {
+		qsort(vec, batch->n, sizeof(ttimer_ref_t *), ttimer_slot_cmp);
+	}
+	while (i < batch->n) {
+		ttimer_ref_t *first = vec[i], *last = first;
+		unsigned j = i + 1;
+
+		while (j < batch->n && vec[j]->slot == first->slot) {
+			last->entry.le_next = vec[j];
+			vec[j]->entry.le_prev = &last->entry.le_next;
+			last = vec[j++];
+		}
+		twheel_link(timer, first->slot, first, last, j - i);
+		i = j;
+	}
+	batch->n = 0;
+}
+
+/*
+ * ttimer_batch_add: activate the entry and determine its slot, but leave
+ * the linking to ttimer_batch_flush(); the entries destined for the
+ * overflow heap are inserted straight away.
+ */
+static void
+ttimer_batch_add(ttimer_t *timer, ttimer_batch_t *batch, ttimer_ref_t *ent,
+    time_t timeout)
+{
+	const uint64_t expire = timer->clock + (uint64_t)timeout;
+	uint64_t due;
+	unsigned slot;
+
+	ASSERT(timeout > 0);
+	ASSERT(ent->func != NULL);
+	ttimer_activate(timer, ent, expire);
+
+	slot = twheel_place(timer, ent, expire, true, &due);
+	if (__predict_false(slot == TTIMER_SLOT_HEAP)) {
+		ttimer_insert(timer, ent, timeout);
+		return;
+	}
+	ent->slot = slot;
+	ent->scheduled = true;
+	batch->due = MIN(batch->due, due);
+
+	batch->vec[batch->n++] = ent;
+	if (batch->n == TTIMER_BATCH_CHUNK) {
+		ttimer_batch_flush(timer, batch);
+	}
+}
+
+static void
+ttimer_batch_done(ttimer_t *timer, ttimer_batch_t *batch)
+{
+	ttimer_batch_flush(timer, batch);
+	if (batch->due != UINT64_MAX) {
+		ttimer_notify(timer,
+		    timer->lastrun + (time_t)(batch->due - timer->clock));
+	}
+}
+
+/*
+ * ttimer_batch_prefetch: prefetch the entry far ahead and, for the one
+ * half way there (its line should be in the cache by then), the list
+ * neighbours, since unlinking the entry writes to them.
+ */
+static inline void
+ttimer_batch_prefetch(ttimer_ref_t **ents, size_t i, size_t count)
+{
+	const size_t near = i + TTIMER_BATCH_PREFETCH / 2;
+
+	if (i + TTIMER_BATCH_PREFETCH < count) {
+		__builtin_prefetch(ents[i + TTIMER_BATCH_PREFETCH], 1);
+	}
+	if (near < count && ents[near]->scheduled) {
+		__builtin_prefetch(ents[near]->entry.le_next, 1);
+		__builtin_prefetch(ents[near]->entry.le_prev, 1);
+	}
+}
+
+/*
+ * ttimer_start_batch: start the timers of the given entries with the
+ * corresponding timeouts.
+ *
+ * => The target slots are determined first; then the entries are sorted
+ *    by the slot (in chunks of TTIMER_BATCH_CHUNK) and each group with the
+ *    same target bucket is inserted in one go, whatever the order of the
+ *    timeouts.  There is a single wake-up notification for the batch.
+ */
+void
+ttimer_start_batch(ttimer_t *timer, ttimer_ref_t **ents,
+    const time_t *timeouts, size_t count)
+{
+	ttimer_batch_t batch = { .n = 0, .due = UINT64_MAX };
+
+	if (timer->heapmode || (timer->flags & TTIMER_HASHED)) {
+		for (size_t i = 0; i < count; i++) {
+			ttimer_start(timer, ents[i], timeouts[i]);
+		}
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		ttimer_batch_prefetch(ents, i, count);
+		ttimer_batch_add(timer, &batch, ents[i], timeouts[i]);
+	}
+	ttimer_batch_done(timer, &batch);
+}
+
+/*
+ * ttimer_stop_batch: stop the timers of the given entries.  Returns the
+ * number of the entries which were active.
+ */
+size_t
+ttimer_stop_batch(ttimer_t *timer, ttimer_ref_t **ents, size_t count)
+{
+	size_t nstopped = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		ttimer_batch_prefetch(ents, i, count);
+		nstopped += ttimer_stop(timer, ents[i]);
+	}
+	return nstopped;
+}
+
+/*
+ * ttimer_restart_batch: re-start the timers of the given entries with
+ * the corresponding timeouts, see ttimer_restart().
+ *
+ * => The entries which cannot stay in place are stopped and grouped by
+ *    their new target bucket, as in ttimer_start_batch().
+ */
+void
+ttimer_restart_batch(ttimer_t *timer, ttimer_ref_t **ents,
+    const time_t *timeouts, size_t count)
+{
+	ttimer_batch_t batch = { .n = 0, .due = UINT64_MAX };
+
+	if (timer->heapmode || (timer->flags & TTIMER_HASHED)) {
+		for (size_t i = 0; i < count; i++) {
+			ttimer_restart(timer, ents[i], timeouts[i]);
+		}
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		ttimer_ref_t *ent = ents[i];
+		const time_t timeout = timeouts[i];
+
+		ASSERT(timeout > 0);
+		ttimer_batch_prefetch(ents, i, count);
+
+		if (ttimer_active(ent)) {
+			ent->expire = timer->clock + (uint64_t)timeout;
+			ent->period = 0;
+			if (ttimer_restart_inplace(timer, ent, timeout)) {
+				continue;
+			}
+		}
+		ttimer_stop(timer, ent);
+		ttimer_batch_add(timer, &batch, ent, timeout);
+	}
+	ttimer_batch_done(timer, &batch);
+}
+
+/*
+ * ttimer_extend: push the expiry of the active timer back to the given
+ * timeout from now.  The entry is not moved: only the new expiry time
+ * is recorded.  Once the entry expires at the original time, it is
+ * re-scheduled for the remaining time instead, see ttimer_fire().
+ *
+ * => If the timer is not active or the new expiry is earlier, then the
+ *    timer is (re-)started as usual.
  */
+void
+ttimer_extend(ttimer_t *timer, ttimer_ref_t *ent, time_t timeout)
+{
+	const uint64_t expire = timer->clock + (uint64_t)timeout;
 
-#define	WHEEL_BUCKETS		(256)
-#define	WHEEL_MAX_LEVELS	(3)
-#define	DIV_BY_BUCKETS(x)	((x) >> 8)
-#define	MOD_BY_BUCKETS(x)	((x) & 0xff)
+	ASSERT(timeout > 0);
 
-typedef struct {
-	unsigned		hand;
-	LIST_HEAD(,ttimer_ref)	bucket[WHEEL_BUCKETS];
-} twheel_t;
+	if (__predict_true(ttimer_active(ent) && expire >= ent->expire)) {
+		ent->expire = expire;
+		return;
+	}
+	ttimer_restart(timer, ent, timeout);
+}
 
-struct ttimer {
-	unsigned		levels;
-	time_t			lastrun;
-	twheel_t		wheel[];
-};
+/*
+ * twheel_target: return the slot for the entry which is being cascaded
+ * from the level with the given shift.  Returns TTIMER_SLOT_EXPIRED if
+ * there is no remaining time and TTIMER_SLOT_RESCHED if the time is
+ * beyond the range of the level.
+ *
+ * => At this point, the lower hands are all at zero, therefore the
+ *    target level is just the highest non-zero "digit" of the remaining
+ *    time and the bucket is that digit; there is no carry to consider.
+ * => The entry which is due in the next lap stays in its bucket.
+ */
+static inline unsigned
+twheel_target(const ttimer_t *timer, const ttimer_ref_t *ent, unsigned shift)
+{
+	const time_t remaining = ent->remaining;
+	unsigned level;
 
-ttimer_t *
-ttimer_create(time_t maxtimeout, time_t now)
+	if (__predict_false(ent->slot & TWHEEL_LAP)) {
+		return ent->slot & ~TWHEEL_LAP;
+	}
+	if (remaining == 0) {
+		return TTIMER_SLOT_EXPIRED;
+	}
+	if (__predict_false((remaining >> shift) ||
+	    (timer->flags & TTIMER_APPROX))) {
+		/* Note: in the approximate mode, nothing is cascaded. */
+		return TTIMER_SLOT_RESCHED;
+	}
+	level = (63 - __builtin_clzll(remaining)) / timer->bits;
+	return (level << timer->bits) +
+	    MOD_BY_BUCKETS(timer, remaining >> TWHEEL_SHIFT(timer, level));
+}
+
+/*
+ * twheel_unlap: return the entries, which were set aside while migrating
+ * the bucket, back into it.  Their lap is over once it is processed.
+ */
+static void
+twheel_unlap(twheel_t *wheel, unsigned n)
 {
-	unsigned len, levels = 0;
-	ttimer_t *timer;
+	ttimer_ref_t *first, *last;
 
-	while (maxtimeout > 0) {
-		maxtimeout = DIV_BY_BUCKETS(maxtimeout);
-		levels++;
+	if ((first = LIST_FIRST(&wheel->lapped)) == NULL) {
+		return;
 	}
-	levels = levels ? MIN(levels, WHEEL_MAX_LEVELS) : WHEEL_MAX_LEVELS;
-	len = offsetof(ttimer_t, wheel[levels]);
+	for (last = first;; last = LIST_NEXT(last, entry)) {
+		last->slot &= ~TWHEEL_LAP;
+		if (LIST_NEXT(last, entry) == NULL) {
+			break;
+		}
+	}
+	LIST_INIT(&wheel->lapped);
+	ttimer_splice(&wheel->bucket[n], first, last);
+	twheel_set(wheel, n);
+}
 
-	if ((timer = calloc(1, len)) == NULL) {
-		return NULL;
+/*
+ * twheel_hashed: process the bucket of the hashed wheel: the entries
+ * with no rounds left expire, the rest have one round less.  The entries
+ * of the cancelled groups are discarded.
+ */
+static void
+twheel_hashed(ttimer_t *timer, unsigned n)
+{
+	twheel_t *wheel = &timer->wheel[0];
+	ttimer_ref_t *ent, *next;
+
+	for (ent = LIST_FIRST(&wheel->bucket[n]); ent != NULL; ent = next) {
+		next = LIST_NEXT(ent, entry);
+		if (__predict_false(!ttimer_active(ent))) {
+			/* Cancelled with its group: discard it now. */
+			LIST_REMOVE(ent, entry);
+			ent->scheduled = false;
+			ttimer_deactivate(timer, ent);
+			continue;
+		}
+		if (ent->remaining) {
+			ent->remaining--;
+			continue;
+		}
+		LIST_REMOVE(ent, entry);
+		LIST_INSERT_HEAD(&timer->expired, ent, entry);
+		ent->slot = TTIMER_SLOT_EXPIRED;
+	}
+	if (LIST_EMPTY(&wheel->bucket[n])) {
+		twheel_clear(wheel, n);
 	}
-	timer->levels = levels;
-	timer->lastrun = now;
-	return timer;
 }
 
-void
-ttimer_destroy(ttimer_t *timer)
+/*
+ * twheel_cascade: process the bucket reached by the hand, i.e. move
+ * the expired entries to the expired list and re-distribute the rest
+ * to the lower levels.
+ *
+ * => The bucket is detached as a whole and the entries are moved in
+ *    runs: the consecutive entries with the same target (e.g. started
+ *    at the same time with the same timeout) are spliced in one go.
+ * => The entries of the cancelled groups are discarded on the way, so
+ *    that they do not stay until their expiry.
+ */
+static void
+twheel_cascade(ttimer_t *timer, unsigned level, unsigned n)
 {
-	free(timer);
+	const unsigned shift = TWHEEL_SHIFT(timer, level);
+	twheel_t *wheel = &timer->wheel[level];
+	ttimer_ref_t *ent, *next, *last;
+	unsigned slot;
+
+	if (timer->flags & TTIMER_HASHED) {
+		twheel_hashed(timer, n);
+		return;
+	}
+	ent = LIST_FIRST(&wheel->bucket[n]);
+	LIST_INIT(&wheel->bucket[n]);
+	twheel_clear(wheel, n);
+	twheel_unlap(wheel, n);
+	if (ent == NULL) {
+		return;
+	}
+	slot = twheel_target(timer, ent, shift);
+
+	while (ent) {
+		unsigned nslot = TTIMER_SLOT_RESCHED, nents = 1;
+		ttimer_list_t *list;
+		time_t mask;
+
+		ASSERT(ent->scheduled);
+		ASSERT((ent->slot & ~TWHEEL_LAP) == (level << timer->bits) + n);
+
+		if (__predict_false(!ttimer_active(ent))) {
+			/* Cancelled with its group: discard it now. */
+			next = LIST_NEXT(ent, entry);
+			twheel_count(timer, wheel, n, -1);
+			ent->scheduled = false;
+			ttimer_deactivate(timer, ent);
+			if ((ent = next) != NULL) {
+				slot = twheel_target(timer, ent, shift);
+			}
+			continue;
+		}
+		if (__predict_false(slot == TTIMER_SLOT_RESCHED)) {
+			/*
+			 * Beyond the range of the level (the final level
+			 * of the long timeouts): re-schedule from scratch.
+			 */
+			next = LIST_NEXT(ent, entry);
+			twheel_count(timer, wheel, n, -1);
+			ent->scheduled = false;
+			ttimer_insert(timer, ent, ent->remaining);
+			if ((ent = next) != NULL) {
+				slot = twheel_target(timer, ent, shift);
+			}
+			continue;
+		}
+
+		if (slot == TTIMER_SLOT_EXPIRED) {
+			list = &timer->expired;
+			mask = 0;
+		} else {
+			const unsigned tlevel = DIV_BY_BUCKETS(timer, slot);
+			twheel_t *twheel = &timer->wheel[tlevel];
+
+			list = &twheel->bucket[MOD_BY_BUCKETS(timer, slot)];
+			twheel_set(twheel, MOD_BY_BUCKETS(timer, slot));
+			mask = ((time_t)1 << TWHEEL_SHIFT(timer, tlevel)) - 1;
+		}
+
+		/*
+		 * Update the entry and extend the run while the next
+		 * entries have the same target.
+		 */
+		last = ent;
+		for (;;) {
+			last->remaining &= mask;
+			last->slot = slot;
+
+			if ((next = LIST_NEXT(last, entry)) == NULL) {
+				break;
+			}
+			nslot = twheel_target(timer, next, shift);
+			if (nslot != slot || !ttimer_active(next)) {
+				break;
+			}
+			last = next;
+			nents++;
+		}
+		ttimer_splice(list, ent, last);
+		if (timer->flags & TTIMER_INCREMENTAL) {
+			wheel->count[n] -= nents;
+			if (slot != TTIMER_SLOT_EXPIRED) {
+				timer->wheel[DIV_BY_BUCKETS(timer, slot)].count[
+				    MOD_BY_BUCKETS(timer, slot)] += nents;
+			}
+		}
+		ent = next;
+		slot = nslot;
+	}
 }
 
-void
-ttimer_setfunc(ttimer_ref_t *ent, ttimer_func_t handler, void *arg)
+/*
+ * twheel_migrate: incremental cascading.  Instead of re-distributing
+ * the whole bucket at once when the hand reaches it, move a part of the
+ * bucket to be processed next to the lower level on every tick before.
+ * The part is the bucket size divided by the ticks left, hence the work
+ * is spread evenly and the processing of the bucket has little left.
+ *
+ * => The entry can be moved to the lower level only if its target bucket
+ *    is not past the lower hand; otherwise, it is placed there with the
+ *    TWHEEL_LAP flag, so that it is skipped once before it is due.
+ * => The entries which already have the flag are due in the next lap
+ *    of this bucket; they are set aside until the hand reaches it.
+ * => The entries of the cancelled groups are discarded.
+ */
+static void
+twheel_migrate(ttimer_t *timer)
 {
-	ent->scheduled = false;
-	ent->func = handler;
-	ent->arg = arg;
+	const uint64_t clock = timer->clock;
+
+	for (unsigned level = 1; level < timer->levels; level++) {
+		const unsigned shift = TWHEEL_SHIFT(timer, level);
+		const unsigned lshift = TWHEEL_SHIFT(timer, level - 1);
+		const unsigned n =
+		    MOD_BY_BUCKETS(timer, TWHEEL_HAND(timer, clock, level) + 1);
+		const unsigned h = TWHEEL_HAND(timer, clock, level - 1);
+		const uint64_t left = (((clock >> shift) + 1) << shift) - clock;
+		twheel_t *wheel = &timer->wheel[level];
+		twheel_t *lower = &timer->wheel[level - 1];
+		ttimer_ref_t *ent;
+		unsigned quota;
+
+		/*
+		 * Nothing to migrate or the bucket is processed on the
+		 * next tick anyway.
+		 */
+		if (left == 1 || !twheel_isset(wheel, n)) {
+			continue;
+		}
+		quota = (wheel->count[n] + left - 1) / left;
+
+		while (quota-- &&
+		    (ent = LIST_FIRST(&wheel->bucket[n])) != NULL) {
+			const time_t remaining = ent->remaining;
+			unsigned d;
+
+			LIST_REMOVE(ent, entry);
+			if (__predict_false(!ttimer_active(ent))) {
+				/* Cancelled with its group: discard it. */
+				wheel->count[n]--;
+				ent->scheduled = false;
+				ttimer_deactivate(timer, ent);
+				continue;
+			}
+			if (ent->slot & TWHEEL_LAP) {
+				LIST_INSERT_HEAD(&wheel->lapped, ent, entry);
+				continue;
+			}
+			wheel->count[n]--;
+
+			if (__predict_false(remaining >> shift)) {
+				/* Beyond the level: re-schedule it. */
+				ent->scheduled = false;
+				ttimer_insert(timer, ent, left + remaining);
+				continue;
+			}
+			d = MOD_BY_BUCKETS(timer, remaining >> lshift);
+			ent->remaining = remaining &
+			    (((time_t)1 << lshift) - 1);
+			ent->slot = ((level - 1) << timer->bits) + d;
+			if (d > h) {
+				ent->slot |= TWHEEL_LAP;
+			}
+			LIST_INSERT_HEAD(&lower->bucket[d], ent, entry);
+			twheel_set(lower, d);
+			lower->count[d]++;
+		}
+		if (LIST_EMPTY(&wheel->bucket[n])) {
+			twheel_clear(wheel, n);
+		}
+	}
 }
 
-void
-ttimer_start(ttimer_t *timer, ttimer_ref_t *ent, time_t timeout)
+/*
+ * ttimer_heap_drain: move the entries of the overflow heap, which have
+ * come within the range of the final level, to the wheel.  In the hybrid
+ * heap mode, move the due entries to the expired list.
+ */
+static void
+ttimer_heap_drain(ttimer_t *timer)
 {
-	unsigned level, r, multiplier;
-	twheel_t *wheel;
+	const uint64_t clock = timer->clock;
 
-	ASSERT(timeout > 0);
-	ASSERT(!ent->scheduled);
-	ASSERT(ent->func != NULL);
+	while (timer->heap_len) {
+		ttimer_ref_t *ent = timer->heap[0];
+		const uint64_t expire = (uint64_t)ent->remaining;
+
+		if (ttimer_heap_due(timer, expire) > clock) {
+			break;
+		}
+		ttimer_heap_remove(timer, ent);
+		if (timer->heapmode) {
+			LIST_INSERT_HEAD(&timer->expired, ent, entry);
+			ent->slot = TTIMER_SLOT_EXPIRED;
+			continue;
+		}
+		ent->scheduled = false;
+		ttimer_insert(timer, ent, (time_t)(expire - clock));
+	}
+}
+
+/*
+ * ttimer_advance: advance the clock by one tick and process the buckets
+ * reached by the hands.  The entries with remaining time are re-scheduled
+ * and the expired ones are moved to the expired list.  No handlers are
+ * called, therefore the processing is pure list manipulation.
+ */
+static void
+ttimer_advance(ttimer_t *timer)
+{
+	const uint64_t clock = ++timer->clock;
+	unsigned level = 0, n;
+
+	/* The time has moved: the wake-up time has to be re-calculated. */
+	timer->wakeup_valid = false;
+
+	if (timer->heapmode) {
+		/* Hybrid mode: the wheel is empty; just check the heap. */
+		ttimer_heap_drain(timer);
+		return;
+	}
 
 	/*
-	 * The algorithm to find the target bucket and the remaining
-	 * time is conceptually the same with the digital clock time.
-	 *
-	 * As an example, let the current time be 22:58:57 i.e. 2 min
-	 * and 3 sec before midnight.  Now consider adding 192 seconds
-	 * to it.  It would result in 23:02:09.  The logic being:
-	 *
-	 * L0 (seconds): (57 + 192) div 60 = 4 rem 9
-	 * L1 (minutes): (58 + 4) div 60 = 1 rem 2
-	 * L2 (hours): (22 + 1) div 24 = 0 rem 23
-	 *
-	 * Hence, the level to insert is L2 (because we reached zero)
-	 * and the bucket to insert is 23 (the remainder).  The remaining
-	 * time is a sum of the previous remainders: 9 + (2 * 60) = 129.
-	 * In other words, once the clock will reach 23:00:00, there will
-	 * be 129 seconds remaining until 23:02:09.
-	 *
-	 * Our timing wheel has 256 units, therefore the time before
-	 * "midnight" is 255:255:255 and we divide and modulus by 256.
+	 * Process the first level in the hierarchy.  We will process
+	 * the next level if the whole level was processed.  Note: the
+	 * hands are already advanced, therefore any re-scheduling will
+	 * not land in the bucket which is being processed.
 	 */
+	do {
+		twheel_t *wheel = &timer->wheel[level];
 
-	level = 0;
-	ent->remaining = 0;
-	multiplier = 1;
-next:
-	wheel = &timer->wheel[level];
-	r = MOD_BY_BUCKETS(wheel->hand + timeout);
-	timeout = DIV_BY_BUCKETS(wheel->hand + timeout);
-
-	/* Switch to the next level if time exceeds the level. */
-	if (__predict_false(timeout > 0)) {
-		ent->remaining += (r * multiplier);
-		multiplier *= WHEEL_BUCKETS;
-		level++;
-
-		if (__predict_true(level < WHEEL_MAX_LEVELS)) {
-			goto next;
+		n = TWHEEL_HAND(timer, clock, level);
+		if (twheel_isset(wheel, n) || !LIST_EMPTY(&wheel->lapped)) {
+			twheel_cascade(timer, level, n);
 		}
 
 		/*
-		 * If we reach the final level, just add the whole
-		 * remaining time.
+		 * Completed processing a unit of the next level (i.e. the
+		 * level has wrapped around, unless in the approximate mode)?
+		 * Process the next one.
 		 */
-		ent->remaining += multiplier * (timeout - 1);
-		level--;
-	}
+	} while (((clock >> TWHEEL_SHIFT(timer, level)) &
+	    ((1U << timer->lvlbits) - 1)) == 0 && ++level < timer->levels);
 
 	/*
-	 * Insert the entry into the wheel bucket and mark as scheduled.
+	 * The final level has moved: the range of the wheel has moved
+	 * too, therefore some entries of the overflow heap may fit now.
 	 */
-	wheel = &timer->wheel[level];
-	LIST_INSERT_HEAD(&wheel->bucket[r], ent, entry);
-	ent->scheduled = true;
+	if (level + 1 >= timer->levels && timer->heap_len) {
+		ttimer_heap_drain(timer);
+	}
 }
 
-bool
-ttimer_stop(ttimer_t *timer, ttimer_ref_t *ent)
+/*
+ * The budget for the handler invocations: the maximum number of calls
+ * and the deadline (monotonic time in nanoseconds).  Zero is no limit.
+ * If the vector is set, then the entries are collected into it instead
+ * of calling their handlers.
+ */
+typedef struct {
+	size_t			ncalls;
+	size_t			maxcalls;
+	uint64_t		until;
+	ttimer_ref_t **		vec;
+} ttimer_budget_t;
+
+static uint64_t
+ttimer_nsec(void)
 {
-	bool stop = ent->scheduled;
+	struct timespec ts;
 
-	if (stop) {
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * UINT64_C(1000000000)) + ts.tv_nsec;
+}
+
+/*
+ * ttimer_fire: call the handlers of the expired entries.  Returns true
+ * if all of them were called and false if the budget was exhausted.
+ *
+ * => At least one handler is called, so that the progress is made.
+ * => The entries, which were extended (see ttimer_extend), are not yet
+ *    due: they are re-scheduled instead.
+ * => The entries of the cancelled groups are discarded.
+ * => The periodic entries are re-scheduled before the handler is called,
+ *    therefore the handler may stop them.  The next expiry is relative to
+ *    the previous one, not to the current time, hence there is no drift;
+ *    the periods which were missed (e.g. due to the approximation) are
+ *    skipped.
+ */
+static bool
+ttimer_fire(ttimer_t *timer, ttimer_budget_t *budget)
+{
+	ttimer_ref_t *ent;
+
+	while ((ent = LIST_FIRST(&timer->expired)) != NULL) {
+		if (budget && budget->ncalls && (
+		    (budget->maxcalls && budget->ncalls >= budget->maxcalls) ||
+		    (budget->until && ttimer_nsec() >= budget->until))) {
+			return false;
+		}
+		ASSERT(ent->scheduled);
+		ASSERT(ent->slot == TTIMER_SLOT_EXPIRED);
 		LIST_REMOVE(ent, entry);
+
+		if (__predict_false(!ttimer_active(ent))) {
+			/* Cancelled with its group: just discard. */
+			ent->scheduled = false;
+			ttimer_deactivate(timer, ent);
+			continue;
+		}
 		ent->scheduled = false;
+
+		if (__predict_false(ent->expire > timer->clock)) {
+			/* Extended: re-schedule for the remaining time. */
+			ttimer_schedule(timer, ent,
+			    (time_t)(ent->expire - timer->clock));
+			continue;
+		}
+		if (ent->period) {
+			const uint64_t clock = timer->clock;
+			const uint64_t period = (uint64_t)ent->period;
+
+			ent->expire += period;
+			if (__predict_false(ent->expire <= clock)) {
+				ent->expire += ((clock - ent->expire) /
+				    period + 1) * period;
+			}
+			ttimer_schedule(timer, ent,
+			    (time_t)(ent->expire - clock));
+		} else {
+			ttimer_deactivate(timer, ent);
+		}
+
+		if (budget && budget->vec) {
+			budget->vec[budget->ncalls++] = ent;
+			continue;
+		}
+		ASSERT(ent->func != NULL);
+		ent->func(ent, ent->arg);
+
+		if (budget) {
+			budget->ncalls++;
+		}
 	}
-	(void)timer;
-	return stop;
+	return true;
 }
 
 /*
@@ -177,45 +2162,173 @@ ttimer_stop(ttimer_t *timer, ttimer_ref_t *ent)
 void
 ttimer_tick(ttimer_t *timer)
 {
-	unsigned ntimeouts = 0, level = 0, n;
-	ttimer_ref_t *ent;
-	twheel_t *wheel;
+	/* Handlers pending from a bounded run go first. */
+	ttimer_fire(timer, NULL);
+	ttimer_advance(timer);
+	ttimer_fire(timer, NULL);
+
+	if (timer->flags & TTIMER_INCREMENTAL) {
+		twheel_migrate(timer);
+	}
+	ttimer_hybrid_check(timer);
+}
+
+/*
+ * twheel_next: return the number of ticks until the next non-empty
+ * bucket of the given level will be processed or zero if the level
+ * has no entries.
+ */
+static uint64_t
+twheel_next(const ttimer_t *timer, unsigned level)
+{
+	const twheel_t *wheel = &timer->wheel[level];
+	const unsigned shift = TWHEEL_SHIFT(timer, level);
+	const uint64_t hand = timer->clock >> shift;
+	unsigned h = MOD_BY_BUCKETS(timer, hand), n, k;
 
 	/*
-	 * Process the first level in the hierarchy.  We will process
-	 * the next level if the whole level was processed.
+	 * Find the first non-empty bucket after the hand.  If none,
+	 * then wrap around: the hand itself is the last to reach.
+	 */
+	if ((n = twheel_find(timer, wheel, h + 1)) != WHEEL_BUCKETS(timer)) {
+		k = n - h;
+	} else if ((n = twheel_find(timer, wheel, 0)) != WHEEL_BUCKETS(timer)) {
+		k = n + WHEEL_BUCKETS(timer) - h;
+	} else {
+		return 0;
+	}
+
+	/*
+	 * The bucket is processed when the level reaches it, i.e. all
+	 * the lower levels wrap around to zero.
 	 */
-next:
-	wheel = &timer->wheel[level];
-	n = MOD_BY_BUCKETS(wheel->hand + 1);
-	while ((ent = LIST_FIRST(&wheel->bucket[n])) != NULL) {
-		time_t remaining = ent->remaining;
+	return ((hand + k) << shift) - timer->clock;
+}
+
+/*
+ * ttimer_next_event: return the number of ticks until the next tick
+ * which has a non-empty bucket to process or zero if there are none.
+ */
+static uint64_t
+ttimer_next_event(const ttimer_t *timer)
+{
+	uint64_t next = 0;
+
+	/* Hybrid mode: the wheel is empty, the heap has all entries. */
+	for (unsigned level = 0; level < timer->levels &&
+	    !timer->heapmode; level++) {
+		const unsigned shift = TWHEEL_SHIFT(timer, level);
+		uint64_t t;
 
 		/*
-		 * Remove the timer entry and:
-		 * - If there is remaining time, re-schedule it.
-		 * - Otherwise, run the callback function.
+		 * The level cannot be processed before its next turn.
+		 * If there is an earlier event, then the higher levels
+		 * cannot have anything sooner.
 		 */
-		ASSERT(ent->scheduled);
-		LIST_REMOVE(ent, entry);
-		ent->scheduled = false;
-
-		if (remaining) {
-			ttimer_start(timer, ent, remaining);
+		t = (((timer->clock >> shift) + 1) << shift) - timer->clock;
+		if (next && next <= t) {
+			break;
+		}
+		if (!LIST_EMPTY(&timer->wheel[level].lapped)) {
+			/* Entries set aside: the next turn processes them. */
+			next = t;
 			continue;
 		}
-		ASSERT(ent->func != NULL);
-		ent->func(ent, ent->arg);
-		ntimeouts++;
+		if ((t = twheel_next(timer, level)) != 0) {
+			next = next ? MIN(next, t) : t;
+		}
+	}
+	if (timer->heap_len) {
+		const uint64_t expire = (uint64_t)timer->heap[0]->remaining;
+		const uint64_t due = ttimer_heap_due(timer, expire);
+		const uint64_t t = due - timer->clock;
+
+		next = next ? MIN(next, t) : t;
+	}
+	return next;
+}
+
+/*
+ * ttimer_next_expiry: return the number of ticks until the earliest
+ * timer expires or -1 if there are no timers scheduled.
+ *
+ * => The value is exact for the timers in the first level.  Otherwise,
+ *    it is the tick at which the timer is re-scheduled to a lower level,
+ *    i.e. a conservative value: nothing can expire before it.
+ */
+time_t
+ttimer_next_expiry(ttimer_t *timer)
+{
+	uint64_t next;
+
+	if (!LIST_EMPTY(&timer->expired)) {
+		/* Expired, but the handlers are still pending. */
+		return 0;
+	}
+	next = ttimer_next_event(timer);
+	return next ? (time_t)next : -1;
+}
+
+/*
+ * ttimer_run: run the ticks up to the given time, see ttimer_run_ticks().
+ * Returns true on completion and false if the budget was exhausted.
+ */
+static bool
+ttimer_run(ttimer_t *timer, time_t now, ttimer_budget_t *budget)
+{
+	const uint64_t clock = timer->clock;
+
+	/*
+	 * First, complete the handlers pending from the previous run.
+	 * They expired earlier, therefore they must be called first.
+	 */
+	if (!ttimer_fire(timer, budget)) {
+		return false;
+	}
+	while (timer->lastrun < now) {
+		const uint64_t left = now - timer->lastrun;
+		uint64_t skip;
+
+		/*
+		 * Fast-forward: jump the hands over all ticks which have
+		 * nothing to process, straight to the next non-empty bucket
+		 * (which may be a cascade).  Hence, the cost depends on the
+		 * number of the timers rather than the number of ticks.
+		 */
+		skip = ttimer_next_event(timer);
+		if (skip == 0 || skip > left) {
+			timer->wakeup_valid = false;
+			timer->clock += left;
+			break;
+		}
+		timer->clock += skip - 1;
+		timer->lastrun += skip - 1;
+
+		ttimer_advance(timer);
+		timer->lastrun++;
+
+		/*
+		 * Call the handlers.  If the budget is exhausted, then the
+		 * remaining ones are left on the expired list and the time
+		 * stays at this tick; the next run will resume from here.
+		 */
+		if (!ttimer_fire(timer, budget)) {
+			return false;
+		}
 	}
-	wheel->hand = n;
+	timer->lastrun = now;
 
 	/*
-	 * Completed processing the level?  Process the next one.
+	 * Incremental cascading: spread the work of the upcoming bucket
+	 * processing over the runs before it.  Note: it is only needed
+	 * at the current time, therefore not on every fast-forward step;
+	 * and only if the time moved, since the quota is per tick.
 	 */
-	if (n == 0 && ++level < timer->levels) {
-		goto next;
+	if ((timer->flags & TTIMER_INCREMENTAL) && timer->clock != clock) {
+		twheel_migrate(timer);
 	}
+	ttimer_hybrid_check(timer);
+	return true;
 }
 
 /*
@@ -225,9 +2338,81 @@ next:
 void
 ttimer_run_ticks(ttimer_t *timer, time_t now)
 {
-	while (timer->lastrun < now) {
-		ttimer_tick(timer);
-		timer->lastrun++;
+	ttimer_run(timer, now, NULL);
+}
+
+/*
+ * ttimer_run_ticks_bounded: run the ticks, but call at most "maxcalls"
+ * handlers and spend at most "nsec" nanoseconds; zero means no limit.
+ * Returns true if all expired events up to "now" were processed and
+ * false if the budget was exhausted.  In the latter case, the progress
+ * is preserved: the next call resumes from the point it stopped.
+ */
+bool
+ttimer_run_ticks_bounded(ttimer_t *timer, time_t now,
+    unsigned maxcalls, uint64_t nsec)
+{
+	ttimer_budget_t budget = {
+		.ncalls = 0,
+		.maxcalls = maxcalls,
+		.until = nsec ? ttimer_nsec() + nsec : 0,
+		.vec = NULL,
+	};
+	return ttimer_run(timer, now, &budget);
+}
+
+/*
+ * ttimer_collect: run the ticks up to "now", but instead of calling the
+ * handlers, detach the expired entries and store them into the given
+ * vector of "count" elements, in the order of expiry.  Returns the
+ * number of stored entries.
+ *
+ * => The entries are no longer scheduled, except the periodic ones which
+ *    are already re-armed; the caller takes care of them.
+ * => If the vector gets full, then the remaining expired entries are
+ *    kept and the next call (or the run of the ticks) resumes from there.
+ */
+size_t
+ttimer_collect(ttimer_t *timer, time_t now, ttimer_ref_t **vec, size_t count)
+{
+	ttimer_budget_t budget = {
+		.ncalls = 0,
+		.maxcalls = count,
+		.until = 0,
+		.vec = vec,
+	};
+
+	if (count == 0) {
+		return 0;
 	}
-	timer->lastrun = now;
+	ttimer_run(timer, now, &budget);
+	return budget.ncalls;
+}
+
+/*
+ * ttimer_next_wakeup: return the absolute time (in the same units as
+ * "now" given to ttimer_run_ticks) when the caller should next run the
+ * ticks or -1 if there are no timers scheduled.
+ *
+ * => The value is cached until the ticks are run.  Starting a timer
+ *    which is due earlier updates the value and notifies the caller
+ *    using the handler set up with ttimer_setwakeup(), if any.
+ */
+time_t
+ttimer_next_wakeup(ttimer_t *timer)
+{
+	if (!timer->wakeup_valid) {
+		const time_t next = ttimer_next_expiry(timer);
+
+		timer->wakeup = (next == -1) ? -1 : timer->lastrun + next;
+		timer->wakeup_valid = true;
+	}
+	return timer->wakeup;
+}
+
+void
+ttimer_setwakeup(ttimer_t *timer, ttimer_wakeup_t func, void *arg)
+{
+	timer->wakeup_func = func;
+	timer->wakeup_arg = arg;
 }
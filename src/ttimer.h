@@ -8,28 +8,115 @@
 #ifndef	_TTIMER_H_
 #define	_TTIMER_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 __BEGIN_DECLS
 
 struct ttimer_ref;
 typedef struct ttimer ttimer_t;
 typedef void (*ttimer_func_t)(struct ttimer_ref *, void *);
+typedef void (*ttimer_wakeup_t)(ttimer_t *, time_t, void *);
+
+typedef struct ttimer_group {
+	/* Private members: */
+	unsigned		gen;
+	unsigned		nrefs;
+} ttimer_group_t;
 
 typedef struct ttimer_ref {
 	/* Private members: */
 	LIST_ENTRY(ttimer_ref)	entry;
 	time_t			remaining;
+	uint64_t		expire;
+	time_t			period;
 	ttimer_func_t		func;
 	void *			arg;
-	bool			scheduled;
+	ttimer_group_t *	group;
+	unsigned		slot;
+	unsigned		gen : 31;
+	unsigned		scheduled : 1;
 } ttimer_ref_t;
 
+/*
+ * Flags for ttimer_create_flags() and ttimer_create_ex().
+ */
+#define	TTIMER_INCREMENTAL	0x01
+#define	TTIMER_APPROX		0x02
+#define	TTIMER_HASHED		0x04
+#define	TTIMER_HYBRID		0x08
+
 ttimer_t *	ttimer_create(time_t, time_t);
+ttimer_t *	ttimer_create_flags(time_t, time_t, unsigned);
+ttimer_t *	ttimer_create_ex(unsigned, unsigned, time_t, unsigned);
 void		ttimer_destroy(ttimer_t *);
+void		ttimer_destroy_drain(ttimer_t *, ttimer_func_t, void *);
+
+ttimer_ref_t *	ttimer_ref_alloc(ttimer_t *);
+void		ttimer_ref_free(ttimer_t *, ttimer_ref_t *);
+
+/*
+ * The handles of the entries allocated by the timer: they are checked,
+ * therefore the stale handle is harmless.  Only the entries allocated
+ * using ttimer_ref_alloc() or ttimer_handle_alloc() have the handles.
+ */
+typedef uint64_t ttimer_handle_t;
+
+ttimer_handle_t	ttimer_handle_alloc(ttimer_t *, ttimer_func_t, void *);
+bool		ttimer_handle_free(ttimer_t *, ttimer_handle_t);
+bool		ttimer_handle_start(ttimer_t *, ttimer_handle_t, time_t);
+bool		ttimer_handle_stop(ttimer_t *, ttimer_handle_t);
+bool		ttimer_handle_restart(ttimer_t *, ttimer_handle_t, time_t);
+ttimer_handle_t	ttimer_handle_get(const ttimer_ref_t *);
+ttimer_ref_t *	ttimer_handle_ref(const ttimer_t *, ttimer_handle_t);
 
 void		ttimer_setfunc(ttimer_ref_t *, ttimer_func_t, void *);
+void		ttimer_setgroup(ttimer_ref_t *, ttimer_group_t *);
 void		ttimer_start(ttimer_t *, ttimer_ref_t *, time_t);
+void		ttimer_start_at(ttimer_t *, ttimer_ref_t *, time_t);
+void		ttimer_start_periodic(ttimer_t *, ttimer_ref_t *, time_t);
+void		ttimer_start_range(ttimer_t *, ttimer_ref_t *, time_t, time_t);
 bool		ttimer_stop(ttimer_t *, ttimer_ref_t *);
+void		ttimer_restart(ttimer_t *, ttimer_ref_t *, time_t);
+void		ttimer_extend(ttimer_t *, ttimer_ref_t *, time_t);
+time_t		ttimer_expires_in(const ttimer_t *, const ttimer_ref_t *);
+
+void		ttimer_start_batch(ttimer_t *, ttimer_ref_t **,
+		    const time_t *, size_t);
+size_t		ttimer_stop_batch(ttimer_t *, ttimer_ref_t **, size_t);
+void		ttimer_restart_batch(ttimer_t *, ttimer_ref_t **,
+		    const time_t *, size_t);
 void		ttimer_run_ticks(ttimer_t *, time_t);
+bool		ttimer_run_ticks_bounded(ttimer_t *, time_t, unsigned, uint64_t);
+size_t		ttimer_collect(ttimer_t *, time_t, ttimer_ref_t **, size_t);
 void		ttimer_tick(ttimer_t *);
+time_t		ttimer_next_expiry(ttimer_t *);
+
+void		ttimer_group_init(ttimer_group_t *);
+void		ttimer_group_cancel(ttimer_group_t *);
+unsigned	ttimer_group_pending(const ttimer_group_t *);
+
+time_t		ttimer_next_wakeup(ttimer_t *);
+void		ttimer_setwakeup(ttimer_t *, ttimer_wakeup_t, void *);
+
+/*
+ * Compact timer: the entries are stored in the arena owned by the timer
+ * and are referenced by the index.  See ttimer_arena.c for the details.
+ */
+typedef struct ttimer_arena ttimer_arena_t;
+typedef void (*ttimer_arena_func_t)(ttimer_arena_t *, uint32_t, void *);
+
+#define	TTIMER_ARENA_HANDLERS	256
+
+ttimer_arena_t *ttimer_arena_create(uint32_t, time_t);
+void		ttimer_arena_destroy(ttimer_arena_t *);
+void		ttimer_arena_sethandler(ttimer_arena_t *, unsigned,
+		    ttimer_arena_func_t, void *);
+void		ttimer_arena_setfunc(ttimer_arena_t *, uint32_t, unsigned);
+bool		ttimer_arena_start(ttimer_arena_t *, uint32_t, time_t);
+bool		ttimer_arena_stop(ttimer_arena_t *, uint32_t);
+bool		ttimer_arena_scheduled(const ttimer_arena_t *, uint32_t);
+void		ttimer_arena_run_ticks(ttimer_arena_t *, time_t);
+time_t		ttimer_arena_next_expiry(ttimer_arena_t *);
 
 #endif
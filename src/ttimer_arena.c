@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Compact tick-based timer.
+ *
+ * This is the same hierarchical timing wheel as in ttimer.c, but with
+ * a compact format of the entries, meant for the very large number of
+ * timers (e.g. one per connection).  The entries are stored in an arena
+ * owned by the timer and are referenced by their 32-bit index.  Each
+ * entry is 16 bytes:
+ *
+ * - The links are the 32-bit indices instead of the pointers.  The
+ *   previous link of the first entry refers to the list head instead
+ *   (the ARENA_HEAD flag and the head number), therefore the entry does
+ *   not need to record its bucket for the removal.
+ * - The remaining time is 32-bit: the timeouts are limited to 2^32 ticks.
+ * - The handler is an index in the handler table of the timer; the
+ *   scheduled flag is packed into the spare bits.
+ *
+ * Hence, about three times more entries fit in the caches compared to
+ * the ttimer_ref_t structure.  The wheel geometry is fixed: three levels
+ * of 256-slot wheels.
+ *
+ * The fields are stored as separate arrays (i.e. the struct-of-arrays
+ * layout), so that the cascade can load the remaining times of many
+ * entries and compute their targets using the SIMD instructions (AVX2
+ * or SSE2, if available at the compile time), see tarena_targets().
+ */
+
+#include <sys/queue.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "ttimer.h"
+#include "utils.h"
+
+#define	ARENA_BITS		(8)
+#define	ARENA_BUCKETS		(1U << ARENA_BITS)
+#define	ARENA_LEVELS		(3)
+#define	ARENA_WORDS		(ARENA_BUCKETS / 64)
+
+#define	ARENA_SHIFT(l)		((l) * ARENA_BITS)
+#define	ARENA_HAND(c, l)	(((c) >> ARENA_SHIFT(l)) & (ARENA_BUCKETS - 1))
+
+/*
+ * The list heads: the buckets of all levels, followed by the list of
+ * the expired entries.  The head number of a bucket is its slot.
+ */
+#define	ARENA_EXPIRED		(ARENA_LEVELS * ARENA_BUCKETS)
+#define	ARENA_NHEADS		(ARENA_EXPIRED + 1)
+
+#define	ARENA_NIL		UINT32_MAX
+#define	ARENA_HEAD		(1U << 31)
+#define	ARENA_MAX_ENTRIES	(ARENA_HEAD - 1)
+
+/*
+ * The meta word: the scheduled flag and the handler index.
+ */
+#define	ARENA_SCHEDULED		(1U << 31)
+#define	ARENA_HID(m)		((m) & 0xffffU)
+
+/*
+ * The number of the entries processed in one batch of the cascade.
+ */
+#define	ARENA_CHUNK		(64)
+
+typedef struct {
+	ttimer_arena_func_t	func;
+	void *			arg;
+} tarena_handler_t;
+
+struct ttimer_arena {
+	uint64_t		clock;
+	time_t			lastrun;
+	uint32_t		nentries;
+
+	/*
+	 * The entries: the arrays of the fields, indexed by the entry.
+	 */
+	uint32_t *		next;
+	uint32_t *		prev;
+	uint32_t *		remaining;
+	uint32_t *		meta;
+	uint64_t		bitmap[ARENA_LEVELS][ARENA_WORDS];
+	uint32_t		head[ARENA_NHEADS];
+	tarena_handler_t	handler[TTIMER_ARENA_HANDLERS];
+};
+
+static inline void
+tarena_bitset(ttimer_arena_t *arena, unsigned slot)
+{
+	arena->bitmap[slot / ARENA_BUCKETS][(slot % ARENA_BUCKETS) >> 6] |=
+	    UINT64_C(1) << (slot & 63);
+}
+
+static inline void
+tarena_bitclear(ttimer_arena_t *arena, unsigned slot)
+{
+	arena->bitmap[slot / ARENA_BUCKETS][(slot % ARENA_BUCKETS) >> 6] &=
+	    ~(UINT64_C(1) << (slot & 63));
+}
+
+/*
+ * tarena_find: return the first non-empty bucket of the level starting
+ * from the given one (inclusive) or ARENA_BUCKETS if there are none.
+ */
+static unsigned
+tarena_find(const ttimer_arena_t *arena, unsigned level, unsigned n)
+{
+	const uint64_t *bitmap = arena->bitmap[level];
+	unsigned i = n >> 6;
+	uint64_t word;
+
+	if (n >= ARENA_BUCKETS) {
+		return ARENA_BUCKETS;
+	}
+	word = bitmap[i] & (UINT64_MAX << (n & 63));
+	while (word == 0) {
+		if (++i == ARENA_WORDS) {
+			return ARENA_BUCKETS;
+		}
+		word = bitmap[i];
+	}
+	return (i << 6) | (unsigned)__builtin_ctzll(word);
+}
+
+/*
+ * tarena_insert: insert the entry at the head of the given list.
+ */
+static inline void
+tarena_insert(ttimer_arena_t *arena, unsigned h, uint32_t idx)
+{
+	const uint32_t first = arena->head[h];
+
+	if ((arena->next[idx] = first) != ARENA_NIL) {
+		arena->prev[first] = idx;
+	}
+	arena->prev[idx] = ARENA_HEAD | h;
+	arena->head[h] = idx;
+
+	if (h != ARENA_EXPIRED) {
+		tarena_bitset(arena, h);
+	}
+}
+
+/*
+ * tarena_remove: remove the entry from its list.  If it was the last
+ * one in the bucket, then clear the bucket in the bitmap.
+ */
+static inline void
+tarena_remove(ttimer_arena_t *arena, uint32_t idx)
+{
+	const uint32_t next = arena->next[idx], prev = arena->prev[idx];
+
+	if (next != ARENA_NIL) {
+		arena->prev[next] = prev;
+	}
+	if ((prev & ARENA_HEAD) == 0) {
+		arena->next[prev] = next;
+		return;
+	}
+	arena->head[prev & ~ARENA_HEAD] = next;
+	if (next == ARENA_NIL && prev != (ARENA_HEAD | ARENA_EXPIRED)) {
+		tarena_bitclear(arena, prev & ~ARENA_HEAD);
+	}
+}
+
+/*
+ * ttimer_arena_create: construct a timer with the arena for the given
+ * number of entries.  The entries are referenced by their index, from
+ * zero to "nentries" (exclusive).
+ */
+ttimer_arena_t *
+ttimer_arena_create(uint32_t nentries, time_t now)
+{
+	ttimer_arena_t *arena;
+
+	if (nentries == 0 || nentries > ARENA_MAX_ENTRIES) {
+		return NULL;
+	}
+	if ((arena = calloc(1, sizeof(ttimer_arena_t))) == NULL) {
+		return NULL;
+	}
+	arena->next = calloc(nentries, 4 * sizeof(uint32_t));
+	if (arena->next == NULL) {
+		free(arena);
+		return NULL;
+	}
+	arena->prev = arena->next + nentries;
+	arena->remaining = arena->prev + nentries;
+	arena->meta = arena->remaining + nentries;
+	for (unsigned i = 0; i < ARENA_NHEADS; i++) {
+		arena->head[i] = ARENA_NIL;
+	}
+	arena->nentries = nentries;
+	arena->lastrun = now;
+	return arena;
+}
+
+void
+ttimer_arena_destroy(ttimer_arena_t *arena)
+{
+	free(arena->next);
+	free(arena);
+}
+
+/*
+ * ttimer_arena_sethandler: set the handler function, with an arbitrary
+ * argument, in the handler table at the given index.
+ */
+void
+ttimer_arena_sethandler(ttimer_arena_t *arena, unsigned hid,
+    ttimer_arena_func_t func, void *arg)
+{
+	ASSERT(hid < TTIMER_ARENA_HANDLERS);
+	arena->handler[hid].func = func;
+	arena->handler[hid].arg = arg;
+}
+
+/*
+ * ttimer_arena_setfunc: set the handler of the entry, as the index in
+ * the handler table.  The entry must not be scheduled.
+ */
+void
+ttimer_arena_setfunc(ttimer_arena_t *arena, uint32_t idx, unsigned hid)
+{
+	ASSERT(idx < arena->nentries);
+	ASSERT(hid < TTIMER_ARENA_HANDLERS);
+	ASSERT((arena->meta[idx] & ARENA_SCHEDULED) == 0);
+	arena->meta[idx] = hid;
+}
+
+bool
+ttimer_arena_scheduled(const ttimer_arena_t *arena, uint32_t idx)
+{
+	ASSERT(idx < arena->nentries);
+	return (arena->meta[idx] & ARENA_SCHEDULED) != 0;
+}
+
+/*
+ * ttimer_arena_start: start the timer for the entry.  The placement is
+ * the same as in ttimer_start(), see the comments there.  Returns false
+ * if the timeout is beyond the range of the arena, i.e. 2^32 ticks.
+ */
+bool
+ttimer_arena_start(ttimer_arena_t *arena, uint32_t idx, time_t timeout)
+{
+	const uint64_t clock = arena->clock;
+	const uint64_t expire = clock + (uint64_t)timeout;
+	unsigned level = 0, shift = 0;
+	uint64_t n;
+
+	ASSERT(idx < arena->nentries);
+	ASSERT(timeout > 0);
+	if (__predict_false((uint64_t)timeout > UINT32_MAX)) {
+		return false;
+	}
+	ASSERT((arena->meta[idx] & ARENA_SCHEDULED) == 0);
+	ASSERT(arena->handler[ARENA_HID(arena->meta[idx])].func != NULL);
+
+	for (;;) {
+		n = expire >> shift;
+		if (__predict_true(n - (clock >> shift) < ARENA_BUCKETS)) {
+			break;
+		}
+		if (__predict_false(level + 1 == ARENA_LEVELS)) {
+			/* Beyond the range: re-calculate when reached. */
+			n = (clock >> shift) + ARENA_BUCKETS - 1;
+			break;
+		}
+		shift += ARENA_BITS;
+		level++;
+	}
+	arena->remaining[idx] = (uint32_t)(expire - (n << shift));
+	arena->meta[idx] |= ARENA_SCHEDULED;
+	tarena_insert(arena, (level * ARENA_BUCKETS) +
+	    (unsigned)(n & (ARENA_BUCKETS - 1)), idx);
+	return true;
+}
+
+bool
+ttimer_arena_stop(ttimer_arena_t *arena, uint32_t idx)
+{
+	ASSERT(idx < arena->nentries);
+	if ((arena->meta[idx] & ARENA_SCHEDULED) == 0) {
+		return false;
+	}
+	tarena_remove(arena, idx);
+	arena->meta[idx] &= ~ARENA_SCHEDULED;
+	return true;
+}
+
+/*
+ * tarena_target: the target list head and the new remaining time for
+ * one entry; the scalar version of tarena_targets(), see below.
+ */
+static inline void
+tarena_target(uint32_t r, unsigned shift, uint32_t *head, uint32_t *nrem)
+{
+	const uint32_t l1 = (r >> 8) ? UINT32_MAX : 0;
+	const uint32_t l2 = (r >> 16) ? UINT32_MAX : 0;
+	const uint32_t d = l2 ? (r >> 16) & 0xff :
+	    (l1 ? (r >> 8) & 0xff : r & 0xff);
+
+	*head = d + (l1 & ARENA_BUCKETS) + (l2 & ARENA_BUCKETS);
+	*head |= r ? 0 : ARENA_EXPIRED;
+	*head |= (r >> shift) ? ARENA_NIL : 0;
+	*nrem = r & ((l1 & 0xff) | (l2 & 0xffff));
+}
+
+/*
+ * tarena_targets: compute the target list heads and the new remaining
+ * times for the given remaining times of the entries being cascaded from
+ * the level with the given shift.  The target is ARENA_EXPIRED if there
+ * is no remaining time and ARENA_NIL if the time is beyond the level.
+ *
+ * => See twheel_target() in ttimer.c: the target level is the highest
+ *    non-zero "digit" of the remaining time.  It is computed using the
+ *    shifts and the comparisons with zero, which vectorise well:
+ *
+ *	l1 = (r >> 8) != 0, l2 = (r >> 16) != 0
+ *	head = digit + (l1 & 256) + (l2 & 256)
+ *	remaining = r & ((l1 & 0xff) | (l2 & 0xffff))
+ *
+ *    where the digit is the corresponding byte of the remaining time.
+ *    The arrays are padded to the multiple of ARENA_CHUNK.
+ */
+static void
+tarena_targets(const uint32_t *rem, uint32_t *head, uint32_t *nrem,
+    unsigned count, unsigned shift)
+{
+	unsigned i = 0;
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi32(-1);
+	const __m256i byte = _mm256_set1_epi32(0xff);
+	const __m256i word = _mm256_set1_epi32(0xffff);
+	const __m256i lvl = _mm256_set1_epi32(ARENA_BUCKETS);
+	const __m256i expired = _mm256_set1_epi32(ARENA_EXPIRED);
+	const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+
+	for (; i < count; i += 8) {
+		const __m256i r = _mm256_loadu_si256((const void *)&rem[i]);
+		const __m256i r8 = _mm256_srli_epi32(r, 8);
+		const __m256i r16 = _mm256_srli_epi32(r, 16);
+		const __m256i z = _mm256_cmpeq_epi32(r, zero);
+		const __m256i l1 = _mm256_xor_si256(
+		    _mm256_cmpeq_epi32(r8, zero), ones);
+		const __m256i l2 = _mm256_xor_si256(
+		    _mm256_cmpeq_epi32(r16, zero), ones);
+		const __m256i over = _mm256_xor_si256(_mm256_cmpeq_epi32(
+		    _mm256_srl_epi32(r, cnt), zero), ones);
+		__m256i d, h, m;
+
+		/* Select the digit: the byte of the highest level. */
+		d = _mm256_blendv_epi8(_mm256_and_si256(r, byte),
+		    _mm256_and_si256(r8, byte), l1);
+		d = _mm256_blendv_epi8(d, _mm256_and_si256(r16, byte), l2);
+		h = _mm256_add_epi32(d, _mm256_add_epi32(
+		    _mm256_and_si256(l1, lvl), _mm256_and_si256(l2, lvl)));
+		h = _mm256_or_si256(h, _mm256_and_si256(z, expired));
+		h = _mm256_or_si256(h, over);
+		m = _mm256_or_si256(_mm256_and_si256(l1, byte),
+		    _mm256_and_si256(l2, word));
+
+		_mm256_storeu_si256((void *)&head[i], h);
+		_mm256_storeu_si256((void *)&nrem[i], _mm256_and_si256(r, m));
+	}
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi32(-1);
+	const __m128i byte = _mm_set1_epi32(0xff);
+	const __m128i word = _mm_set1_epi32(0xffff);
+	const __m128i lvl = _mm_set1_epi32(ARENA_BUCKETS);
+	const __m128i expired = _mm_set1_epi32(ARENA_EXPIRED);
+	const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+
+	for (; i < count; i += 4) {
+		const __m128i r = _mm_loadu_si128((const void *)&rem[i]);
+		const __m128i r8 = _mm_srli_epi32(r, 8);
+		const __m128i r16 = _mm_srli_epi32(r, 16);
+		const __m128i z = _mm_cmpeq_epi32(r, zero);
+		const __m128i l1 = _mm_xor_si128(
+		    _mm_cmpeq_epi32(r8, zero), ones);
+		const __m128i l2 = _mm_xor_si128(
+		    _mm_cmpeq_epi32(r16, zero), ones);
+		const __m128i over = _mm_xor_si128(_mm_cmpeq_epi32(
+		    _mm_srl_epi32(r, cnt), zero), ones);
+		__m128i d, h, m;
+
+		/*
+		 * Select the digit: the byte of the highest level.  Note:
+		 * the level 2 implies the level 1, hence the and-not.
+		 */
+		d = _mm_or_si128(_mm_andnot_si128(l1, _mm_and_si128(r, byte)),
+		    _mm_and_si128(_mm_andnot_si128(l2, l1),
+		    _mm_and_si128(r8, byte)));
+		d = _mm_or_si128(d,
+		    _mm_and_si128(l2, _mm_and_si128(r16, byte)));
+		h = _mm_add_epi32(d, _mm_add_epi32(_mm_and_si128(l1, lvl),
+		    _mm_and_si128(l2, lvl)));
+		h = _mm_or_si128(h, _mm_and_si128(z, expired));
+		h = _mm_or_si128(h, over);
+		m = _mm_or_si128(_mm_and_si128(l1, byte),
+		    _mm_and_si128(l2, word));
+
+		_mm_storeu_si128((void *)&head[i], h);
+		_mm_storeu_si128((void *)&nrem[i], _mm_and_si128(r, m));
+	}
+#endif
+	/* Scalar fallback (or the tail). */
+	for (; i < count; i++) {
+		tarena_target(rem[i], shift, &head[i], &nrem[i]);
+	}
+}
+
+/*
+ * tarena_cascade: process the bucket reached by the hand: move the
+ * expired entries to the expired list and re-distribute the rest.
+ *
+ * => The entries are processed in batches: the indices are collected
+ *    by walking the list (only the links are touched), then the targets
+ *    are computed for the whole batch and, finally, the entries are
+ *    inserted into their target lists.
+ */
+static void
+tarena_cascade(ttimer_arena_t *arena, unsigned level, unsigned n)
+{
+	const unsigned shift = ARENA_SHIFT(level);
+	const unsigned slot = (level * ARENA_BUCKETS) + n;
+	uint32_t idx = arena->head[slot];
+
+	arena->head[slot] = ARENA_NIL;
+	tarena_bitclear(arena, slot);
+
+	while (idx != ARENA_NIL) {
+		uint32_t ents[ARENA_CHUNK], rem[ARENA_CHUNK];
+		uint32_t head[ARENA_CHUNK], nrem[ARENA_CHUNK];
+		unsigned count = 0;
+
+		/* Collect the batch and gather the remaining times. */
+		while (idx != ARENA_NIL && count < ARENA_CHUNK) {
+			ents[count] = idx;
+			rem[count++] = arena->remaining[idx];
+			idx = arena->next[idx];
+		}
+		for (unsigned i = count; i < ARENA_CHUNK; i++) {
+			rem[i] = 0;
+		}
+		tarena_targets(rem, head, nrem, count, shift);
+
+		for (unsigned i = 0; i < count; i++) {
+			const uint32_t e = ents[i];
+
+			if (__predict_false(head[i] == ARENA_NIL)) {
+				/* Beyond the level: re-schedule it. */
+				arena->meta[e] &= ~ARENA_SCHEDULED;
+				(void)ttimer_arena_start(arena, e, rem[i]);
+				continue;
+			}
+			arena->remaining[e] = nrem[i];
+			tarena_insert(arena, head[i], e);
+		}
+	}
+}
+
+/*
+ * tarena_advance: advance the clock by one tick and process the buckets
+ * reached by the hands, see ttimer_advance() in ttimer.c.
+ */
+static void
+tarena_advance(ttimer_arena_t *arena)
+{
+	const uint64_t clock = ++arena->clock;
+	unsigned level = 0, n;
+
+	do {
+		n = ARENA_HAND(clock, level);
+		if (arena->head[(level * ARENA_BUCKETS) + n] != ARENA_NIL) {
+			tarena_cascade(arena, level, n);
+		}
+	} while (n == 0 && ++level < ARENA_LEVELS);
+}
+
+/*
+ * tarena_fire: call the handlers of the expired entries.
+ */
+static void
+tarena_fire(ttimer_arena_t *arena)
+{
+	uint32_t idx;
+
+	while ((idx = arena->head[ARENA_EXPIRED]) != ARENA_NIL) {
+		const tarena_handler_t *h;
+
+		h = &arena->handler[ARENA_HID(arena->meta[idx])];
+		tarena_remove(arena, idx);
+		arena->meta[idx] &= ~ARENA_SCHEDULED;
+		h->func(arena, idx, h->arg);
+	}
+}
+
+/*
+ * tarena_next_event: return the number of ticks until the next tick
+ * which has a non-empty bucket to process or zero if there are none.
+ * See ttimer_next_event() in ttimer.c.
+ */
+static uint64_t
+tarena_next_event(const ttimer_arena_t *arena)
+{
+	const uint64_t clock = arena->clock;
+	uint64_t next = 0;
+
+	for (unsigned level = 0; level < ARENA_LEVELS; level++) {
+		const unsigned shift = ARENA_SHIFT(level);
+		const uint64_t hand = clock >> shift;
+		const unsigned h = hand & (ARENA_BUCKETS - 1);
+		uint64_t t;
+		unsigned n, k;
+
+		t = ((hand + 1) << shift) - clock;
+		if (next && next <= t) {
+			break;
+		}
+		/* See twheel_next() in ttimer.c. */
+		if ((n = tarena_find(arena, level, h + 1)) < ARENA_BUCKETS) {
+			k = n - h;
+		} else if ((n = tarena_find(arena, level, 0)) < ARENA_BUCKETS) {
+			k = n + ARENA_BUCKETS - h;
+		} else {
+			continue;
+		}
+		t = ((hand + k) << shift) - clock;
+		next = next ? MIN(next, t) : t;
+	}
+	return next;
+}
+
+/*
+ * ttimer_arena_run_ticks: run the ticks up to the given time, skipping
+ * the ones which have nothing to process; see ttimer_run_ticks().
+ */
+void
+ttimer_arena_run_ticks(ttimer_arena_t *arena, time_t now)
+{
+	while (arena->lastrun < now) {
+		const uint64_t left = now - arena->lastrun;
+		const uint64_t skip = tarena_next_event(arena);
+
+		if (skip == 0 || skip > left) {
+			arena->clock += left;
+			break;
+		}
+		arena->clock += skip - 1;
+		arena->lastrun += skip - 1;
+
+		tarena_advance(arena);
+		arena->lastrun++;
+		tarena_fire(arena);
+	}
+	arena->lastrun = now;
+}
+
+/*
+ * ttimer_arena_next_expiry: return the number of ticks until the next
+ * timer may expire or -1 if there are none; see ttimer_next_expiry().
+ */
+time_t
+ttimer_arena_next_expiry(ttimer_arena_t *arena)
+{
+	const uint64_t next = tarena_next_event(arena);
+	return next ? (time_t)next : -1;
+}